@@ -5,14 +5,24 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -22,6 +32,11 @@
 #define TEXTOPRAK_VERSION "0.0.1"
 #define TEXTOPRAK_TAB_STOP_DEFAULT 8
 #define TEXTOPRAK_QUIT_TIMES_DEFAULT 3
+#define TEXTOPRAK_MMAP_OPEN_DEFAULT 1
+#define TEXTOPRAK_SYNTAX_DIR_DEFAULT "syntax"
+#define TEXTOPRAK_UNDO_MEMORY_DEFAULT 64  // MiB
+#define TEXTOPRAK_PAGE_MEMORY_DEFAULT 512  // MiB
+#define TEXTOPRAK_JOURNAL_DEFAULT 1
 #define TEXTOPRAK_CONFIG_FILENAME ".textoprakrc"
 #define DEFAULT_BUFFER_SIZE 80
 
@@ -39,9 +54,13 @@ enum editorKey {
 	HOME_KEY,
 	END_KEY,
 	PAGE_UP,
-	PAGE_DOWN
+	PAGE_DOWN,
+	PASTE_START  // bracketed paste, the text follows until PASTE_END
 };
 
+#define PASTE_END "\x1b[201~"
+#define PASTE_END_LEN 6
+
 enum editorHighlight {
 	HL_NORMAL = 0,
 	HL_COMMENT,
@@ -56,11 +75,76 @@ enum editorHighlight {
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+// Lexer state carried from the end of one row into the next: whether a
+// multiline comment is open and the quote of a string continued with '\'
+#define HL_STATE_COMMENT (1<<0)
+#define HL_STATE_STRING(q) ((q) << 8)
+#define HL_STATE_QUOTE(state) (((state) >> 8) & 0xff)
+
+// Rows lexed past the visible ones per frame or idle step
+#define TEXTOPRAK_HL_BUDGET 4096
+
+// Rows and newlines handed to one writev when saving, and the most
+// bytes written by one
+#define SAVE_IOV_BATCH 1024
+#define SAVE_BATCH_BYTES (64 << 20)
+
+// Journal records buffered before they are written, and how long a
+// record may wait for its fsync
+#define JOURNAL_BUFFER_SIZE (64 << 10)
+#define JOURNAL_SYNC_MS 1000
+#define JOURNAL_MAGIC "TXJ1"
+
+#define INPUT_BUFFER_SIZE 4096
+#define ESC_SEQ_TIMEOUT_MS 100  // wait for the rest of an escape sequence
+#define STATUS_MESSAGE_SECONDS 5
+
 /* data */
 
 struct config {
 	int tab_stop;
 	int quit_times;
+	int mmap_open;  // map files instead of reading them line by line
+	char *syntax_dir;  // directory with *.syntax language definitions
+	int undo_memory;  // MiB of undo history kept
+	int page_memory;  // MiB, bigger files are opened paged
+	int journal;  // journal edits next to the file for crash recovery
+};
+
+// Keywords of a syntax compiled into a collision free hash table. Words
+// are offsets into the table's pool so that it can be cached on disk.
+struct keyword {
+	int off;
+	int len;  // 0 for an empty slot
+	int hl;   // HL_KEYWORD1 or HL_KEYWORD2
+};
+
+#define SYNTAX_DELIM_MAX 16
+
+// Byte classes of the lexer's transition table
+#define SC_SEP (1<<0)    // separates words
+#define SC_DIGIT (1<<1)  // may start or continue a number
+#define SC_DOT (1<<2)    // may continue a number
+#define SC_TOKEN (1<<3)  // may start a comment or a string
+
+// A syntax compiled into the tables the lexer runs on. Everything before
+// kw_slots is plain data and goes to the syntax cache as it is.
+struct syntaxTables {
+	unsigned char cls[256];    // SC_* classes of every byte
+	unsigned char quote[256];  // 1 if the byte opens a string
+	char scs[SYNTAX_DELIM_MAX];
+	char mcs[SYNTAX_DELIM_MAX];
+	char mce[SYNTAX_DELIM_MAX];
+	int scs_len;
+	int mcs_len;
+	int mce_len;
+	unsigned int kw_seed;
+	unsigned int kw_mask;  // number of keyword slots - 1
+	int kw_minlen;
+	int kw_maxlen;
+	int pool_len;
+	struct keyword *kw_slots;
+	char *pool;
 };
 
 struct editorSyntax {
@@ -71,19 +155,380 @@ struct editorSyntax {
 	char *multiline_comment_start;
 	char *multiline_comment_end;
 	int flags;
+	char *quotes;      // bytes that open a string, NULL for "'
+	char *separators;  // NULL for the default separators
+	struct syntaxTables *tables;  // built by editorSyntaxCompile
+};
+
+struct rowNode;
+
+// One character cell of the terminal. ch holds the UTF-8 bytes of the
+// character and the marks drawn over it, padded with zeros. The cell
+// right of a wide character is empty. attr is the SGR foreground color
+// (0 for the default) plus CELL_INVERSE for reverse video.
+#define CELL_INVERSE 0x80
+#define CELL_BYTES 7
+
+struct screenCell {
+	char ch[CELL_BYTES];
+	unsigned char attr;
+};
+
+// A run of render bytes sharing one highlight class. Rows only keep the
+// runs that are not HL_NORMAL, everything in between is plain text.
+#define HL_SPAN_MAXLEN 0xffffff
+
+struct hlSpan {
+	int start;
+	unsigned int len : 24;
+	unsigned int hl : 8;
 };
 
 typedef struct erow {
-	int idx;
+	struct rowNode *leaf;  // leaf node holding this row, index is derived
 	int size;
 	int rsize;
+	int rcap;         // room in render, 0 while render is chars
 	char *chars;      // actual characters, '\t'
 	char *render;     // printed characters to console, \t ='    ' 
-	unsigned char *hl;
-	int hl_open_comment;
+	struct colMark *cmap;  // where chars, render and screen columns part
+	int cmap_len;
+	struct hlSpan *hl;  // highlight runs of render, sorted by start
+	int hl_nspans;
+	int hl_state;     // lexer state at the end of the row
+	int hl_in;        // lexer state the row was lexed with, -1 if never
+	int stale;        // chars changed since render and hl were built
+	int damaged;      // looks different than when it was last drawn
 	int line_no;
+	int mapped;       // chars points into E.map until the row is first edited
+	int epoch;        // E.epoch when the row got its chars
 } erow;
 
+// Positions in a row are counted in chars bytes, render bytes or screen
+// columns. They only go apart at tabs and at characters that are not one
+// byte wide, the row's column map has a mark at each of those with its
+// position and length in all three.
+enum rowPos {
+	POS_CHARS = 0,
+	POS_RENDER,
+	POS_SCREEN
+};
+
+struct colMark {
+	int at[3];
+	unsigned char len[3];
+};
+
+// Rows live in the leaves of a counted B-tree so that inserting, deleting
+// and looking up a row by index are O(log n) instead of shifting the
+// whole array. Every node knows how many rows are below it and how many
+// bytes they take in the file, which maps lines to byte offsets and back
+// in O(log n) as well. There is one tree per page of the file, see the
+// row storage section.
+#define ROWTREE_FANOUT 64
+#define ROWTREE_MIN_FILL (ROWTREE_FANOUT / 4)
+#define ROWTREE_MAX_DEPTH 32  // more than INT_MAX rows need
+
+struct rowNode {
+	struct rowNode *parent;
+	int leaf;   // 1 if this is a rowLeaf, 0 if a rowInner
+	int n;      // used slots
+	int count;  // number of rows in this subtree
+	long long bytes;  // size of those rows plus a newline each
+	int page;   // index in E.pages of the tree this node is in
+	int epoch;  // E.epoch when it was made or copied for a save
+	struct rowNode **slot;  // where the tree a save writes points to it
+	int slot_epoch;  // E.epoch of the save slot is for
+};
+
+struct rowInner {
+	struct rowNode node;
+	struct rowNode *child[ROWTREE_FANOUT];
+};
+
+struct rowLeaf {
+	struct rowNode node;
+	erow rows[ROWTREE_FANOUT];
+};
+
+// Part of the file at a line boundary, with the rows that came from it
+#define ROWPAGE_BYTES (1 << 20)
+
+struct rowPage {
+	long long offset;  // where it starts in E.map
+	long long len;
+	int count;  // rows in the page now
+	long long bytes;  // their size plus a newline each
+	struct rowNode *root;  // row tree while the page is loaded, or NULL
+	long long cost;  // memory it took to load
+	int dirty;  // rows differ from the file, the page can't be unloaded
+	int lru_prev;  // loaded pages, most recently used first
+	int lru_next;
+};
+
+// Append buffer initialization. The frame buffer is kept across frames
+// and only grows, so a redraw normally does not allocate at all.
+struct abuf {
+	char *b;
+	int len;
+	int cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+// A regex compiled into Thompson NFA programs, see the regex section
+struct regexInst {
+	int op;    // RE_*
+	int x, y;  // targets of RE_SPLIT and RE_JMP
+	unsigned char set[32];  // bytes RE_CHAR takes, one bit each
+};
+
+struct regexProg {
+	struct regexInst *inst;
+	int ninst;
+};
+
+struct regex {
+	struct regexProg fwd;  // runs over the text left to right
+	struct regexProg rev;  // runs over it right to left
+	char *must;  // bytes every match contains
+	int must_len;
+	int id;  // tells the DFA caches of different patterns apart
+};
+
+// A DFA state is a set of program instructions that are alive at once
+struct dfaState {
+	int *pcs;  // sorted instructions
+	int npcs;
+	int match;      // a match ends here
+	int eol_match;  // a match ends here if the text ends here
+};
+
+// The part of a DFA built so far. It is mutated while it runs, so every
+// thread searching with a regex has its own.
+struct regexDfa {
+	struct regexProg *prog;
+	int anchored;  // 0 if matches may start anywhere
+	struct dfaState *states;
+	int *next;  // 256 transitions of every state, see DFA_NEXT
+	unsigned char *stop;  // DFA_STOP_* of every state
+	int nstates;
+	int states_cap;
+	int flushes;   // times the states were thrown away
+	int start[2];  // start state inside and at the beginning of the text
+	int *table;    // hash table of state indices, -1 for an empty slot
+	unsigned char *mark;  // scratch for closures
+	int *stack;
+	int *set;
+	int *eol_set;
+};
+
+struct regexCache {
+	int id;  // regex the DFAs were built for
+	struct regexDfa any;      // forward, tells if and where a match ends
+	struct regexDfa back;     // reversed, finds where the leftmost one starts
+	struct regexDfa longest;  // forward and anchored, finds its end
+};
+
+// Buffers a thread scans rows with
+struct searchWorkspace {
+	char *scratch;  // render of rows with tabs
+	int scratch_cap;
+	struct regexCache re;
+};
+
+// Where a scan of a paged file is, see searchPagedRow()
+struct searchCursor {
+	int page;    // -1 before the first row
+	int first;   // index of the first row of page
+	int at;      // index of the row at s
+	char *s;     // in the mapping, NULL for an edited page
+	char *from;  // where the scan started in the mapping
+};
+
+// A save running on the writer thread, see the file i/o section. A page
+// is written from its row tree as it was when the save started, or if
+// root is NULL as the len bytes of the mapping at chars.
+struct savePage {
+	struct rowNode *root;
+	char *chars;
+	long long len;
+};
+
+struct saveJob {
+	int active;  // the writer thread is running
+	int again;   // save once more when it is done
+	pthread_t thread;
+	char *path;
+	struct savePage *pages;  // the pages when the save started
+	int npages;
+	struct rowNode **copies;  // nodes copied for pages, see rowNodeTouch
+	int ncopies;
+	int copies_cap;
+	long long total;
+	int epoch;  // rows and nodes of this epoch or older are in pages
+	int dirty;  // E.dirty when the rows were taken
+	char **retired;  // chars replaced or dropped while the writer runs
+	int nretired;
+	int retired_cap;
+	pthread_mutex_t lock;  // guards written, done, error and the trees of pages
+	long long written;
+	int done;
+	int error;  // errno of a failed save
+	int wake_pipe[2];  // wakes up poll when the writer gets further
+};
+
+// Undo history, see the undo section
+enum undoType {
+	UNDO_GROUP,        // starts what one undo takes back
+	UNDO_INSERT_TEXT,  // text went into row at at col
+	UNDO_DELETE_TEXT,  // text left row at at col
+	UNDO_INSERT_ROWS,  // count rows went in at at
+	UNDO_DELETE_ROWS   // count rows left at at
+};
+
+struct undoRecord {
+	int type;
+	int at;
+	int col;
+	int count;  // rows, or for text whether its data is stored backwards
+	int len;  // bytes of data following the record
+};
+
+struct undoCursor {
+	int cx, cy;  // before the group
+	int redo_cx, redo_cy;  // after it
+};
+
+struct undoLog {
+	char *buf;  // records back to back, each followed by its size
+	size_t start;  // oldest record kept
+	size_t end;
+	size_t cap;
+	size_t undo_end;  // records from here on were undone
+	size_t group;  // UNDO_GROUP record edits are added to
+	int open;  // the group at group takes more edits
+	int paused;  // edits are not recorded, e.g. while opening a file
+	int cx, cy;  // cursor before the key being processed
+};
+
+// A journal starts with the header of the file its edits apply to and
+// goes on with records, each followed by the text or row it inserts.
+// Records use the undo types with count 1 for rows. sum covers the
+// record and its data and ends a replay at a torn write.
+struct journalHeader {
+	char magic[4];
+	int pad;
+	long long size;
+	long long mtime;  // ns
+	long long ino;
+};
+
+struct journalRecord {
+	int type;
+	int at;
+	int col;
+	int len;
+	unsigned int sum;
+};
+
+struct journal {
+	int fd;  // -1 while edits are not journaled
+	char *path;
+	char *buf;  // records not written yet
+	int len;
+	int cap;
+	long long size;  // of the journal, buf included
+	long long due;   // when buf must be synced, 0 if it needs not
+	long long save_mark;  // size when the running save took the rows
+};
+
+// Rows that contain a prefix of the search query, see the find section
+struct searchLevel {
+	int qlen;    // length of the prefix
+	int *rows;   // sorted indices of the rows containing it
+	int nrows;
+	int done;    // 0 while workers are still scanning for it
+};
+
+// Scan of the top level by the worker threads. The candidates are cut
+// into chunks of SEARCH_CHUNK_ROWS, chunk_n is -1 until one is scanned.
+struct searchJob {
+	int active;       // the top level is being scanned
+	const int *from;  // candidate rows, NULL for every row
+	int n;            // number of candidates
+	int nchunks;
+	int next_chunk;   // first chunk no worker has taken yet
+	int merged;       // chunks already appended to the level
+	int busy;         // workers scanning a chunk right now
+	int found;        // rows found in all scanned chunks
+	int **chunk_rows;
+	int *chunk_n;
+};
+
+// State of one search, from opening the prompt to Enter or ESC
+struct searchSession {
+	char *query;  // query the levels were built for
+	int qlen;
+	struct searchLevel *levels;  // candidates for ever longer prefixes
+	int nlevels;
+	int levels_cap;
+	int last_match;  // -1: no match
+	int direction;   // -1: backward search, 1: forward search
+	int regex;       // the query is a regex, not a literal
+	struct regex re;
+	int bad;         // the query is not a valid regex
+	size_t skip[256];  // Horspool shifts for the query
+	struct searchWorkspace ws;  // of the main thread
+	struct searchJob job;
+	pthread_t *workers;  // started with the first big scan
+	int nworkers;
+	pthread_mutex_t lock;  // guards job against the workers
+	pthread_cond_t work;   // a job was started
+	pthread_cond_t idle;   // busy dropped to 0
+	int wake_pipe[2];  // wakes up poll when a chunk is scanned
+};
+
+enum benchKind {
+	BENCH_EDIT = 0,
+	BENCH_PASTE,
+	BENCH_MOVE,
+	BENCH_SEARCH,
+	BENCH_UNDO,
+	BENCH_SAVE,
+	BENCH_OTHER,
+	BENCH_KINDS
+};
+
+// Latencies of one kind of operation in a --bench run
+struct benchOps {
+	long long *ns;
+	int n;
+	int cap;
+	long long allocs;  // made by all of them
+};
+
+struct bench {
+	int active;
+	char *path;  // of the script
+	char *script;  // keys to replay, as the terminal sends them
+	int len;
+	int pos;  // next byte to feed
+	int key_end;  // end of the key being fed
+	int kind;  // of the operation the key started
+	int prompt;  // kind the keys typed into a prompt count for, -1 if none
+	int rows, cols;  // of the fake terminal
+	long long start;
+	long long op_start;  // 0 between operations
+	long long op_allocs;  // allocs when the operation started
+	struct benchOps ops[BENCH_KINDS];
+	long long *frames;  // bytes each frame sent
+	int nframes;
+	int frames_cap;
+	long long allocs;  // calls into the allocator
+	long long alloc_bytes;
+};
+
 struct editorConfig {
 	int cx, cy;  // Cursor x and y positions
 	int rx;
@@ -92,14 +537,59 @@ struct editorConfig {
 	int screenrows;
 	int screencols;
 	int numrows;
-	erow *row;  // array of rows
+	struct rowPage *pages;  // rows page by page, see row storage
+	int npages;
+	int *page_lines;  // Fenwick trees of the pages' count and bytes
+	long long *page_bytes;
+	int lru_head;  // most recently used loaded page, -1 if none
+	int lru_tail;
+	long long page_resident;  // memory taken by loaded pages
+	int paged;  // the file is too big to be loaded at once
+	int remap;  // it was saved, map it again between keys
 	int dirty;  // check if content differs from terminal
 	char *filename;
 	char *username;
 	char statusmsg[DEFAULT_BUFFER_SIZE];
 	time_t statusmsg_time;
+	int statusmsg_drawn;  // the message bar shows statusmsg
 	struct editorSyntax *syntax;
+	struct editorSyntax **syntaxes;  // loaded from syntax files
+	int nsyntaxes;
+	int *hl_pending;  // sorted rows whose lexer state must be rechecked
+	int hl_npending;
+	int hl_pending_cap;
+	struct screenCell *screen;  // what the terminal shows, line by line
+	struct screenCell *screen_line;  // scratch line a frame is drawn into
+	unsigned char *screen_dirty;  // lines that must be rebuilt
+	int screen_rows;  // size of screen, 0 until the terminal was cleared
+	int screen_cols;
+	int screen_rowoff;  // rowoff and coloff the text lines were drawn with
+	int screen_coloff;
+	int damage_from;  // rows from here on moved, INT_MAX if none did
+	int term_x;  // terminal cursor, -1 if unknown
+	int term_y;
+	int term_attr;  // attributes the terminal draws with
+	struct searchSession search;
+	struct saveJob save;
+	struct undoLog undo;
+	struct journal journal;
+	struct bench bench;  // set up before initEditor, left alone by it
+	int epoch;  // bumped whenever a save takes the rows
+	int match_row;  // search match drawn over the row, -1 if none
+	int match_rx;
+	int match_len;
+	char *map;  // read-only mapping of the opened file, if any
+	size_t mapsize;
 	struct termios orig_termios;
+	int outfd;  // non-blocking descriptor frames are written to
+	struct abuf out;  // frame the terminal has not taken completely yet
+	int out_sent;  // bytes of out already written
+	int redraw;  // a frame was dropped while out was pending
+	volatile sig_atomic_t resized;  // SIGWINCH came since the size was read
+	int winch_pipe[2];  // wakes up poll when the terminal is resized
+	char inbuf[INPUT_BUFFER_SIZE];  // typed bytes not decoded yet
+	int inpos;
+	int inlen;
 };
 
 struct editorConfig E;
@@ -140,14 +630,16 @@ struct editorSyntax HLDB[] = {
 		C_HL_extensions,
 		C_HL_keywords,
 		"//", "/*", "*/",
-		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+		NULL, NULL, NULL
 	},
 	{
 		"python",
 		PY_HL_extensions,
 		PY_HL_keywords,
 		"#", "'''", "'''",
-		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+		NULL, NULL, NULL
 	},
 };
 
@@ -158,18 +650,54 @@ struct editorSyntax HLDB[] = {
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen(void);
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+int editorSyntaxPending(void);
+int editorSyntaxIdle(void);
+int editorOutputPending(void);
+int getWindowSize(int *rows, int *cols);
+void abAppend(struct abuf *ab, const char *s, int len);
+int editorFlushOutput(void);
+int editorInputPending(void);
+void editorSearchUpdate(void);
+void editorSaveRetire(char *chars);
+void editorSaveUpdate(void);
+void editorSaveWait(void);
+int editorSavePercent(void);
+void editorSave(void);
+void undoRecordText(int type, erow *row, int col, const char *s, int len);
+void undoRecordRow(int type, int at, const char *s, int len);
+void editorRowLayout(erow *row);
+void editorRowFreeRender(erow *row);
+void journalSync(void);
+void journalRecordText(int type, erow *row, int col, const char *s, int len);
+void journalRecordRow(int type, int at, const char *s, int len);
+void journalSaved(void);
+int journalTimeout(void);
+void journalUpdate(void);
+int writeAll(int fd, struct iovec *iov, int n);
+int benchFeed(void);
+void benchFrame(int bytes);
 
 /* terminal */
 
-void die(const char *s) {
+// Leave a blank screen behind. A benchmark has no terminal, its stdout
+// carries the report.
+void editorClearTerminal(void) {
+	if (E.bench.active) return;
 	write(STDOUT_FILENO, "\x1b[2J", 4);
 	write(STDOUT_FILENO, "\x1b[H", 3);
+}
+
+void die(const char *s) {
+	// Edits made up to here can be recovered
+	journalSync();
+	editorClearTerminal();
 	
 	perror(s);
 	exit(1);
 }
 
 void disableRawMode(void) {
+	write(STDOUT_FILENO, "\x1b[?2004l", 8);
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) != 0)
 		die("tcsetattr");
 }
@@ -194,33 +722,183 @@ void enableRawMode(void) {
 
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) != 0)
 		die("tcsetattr");
+
+	// Have pasted text bracketed so it is not taken for typed keys
+	write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-int editorReadKey(void) {
-	int nread;
-	char c;
-	while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-		if (nread == -1 && errno != EAGAIN) die("read");
+// Frames are written through a descriptor of their own so that a slow
+// terminal never blocks the editor. stdin and stdout usually share one
+// open file, setting O_NONBLOCK on stdout would affect reading keys too.
+int editorOpenOutput(void) {
+	if (E.bench.active) return open("/dev/null", O_WRONLY);
+	char *tty = ttyname(STDOUT_FILENO);
+	int fd = tty ? open(tty, O_WRONLY | O_NOCTTY | O_NONBLOCK) : -1;
+	return fd == -1 ? STDOUT_FILENO : fd;
+}
+
+// The terminal size is only read again after SIGWINCH. The handler sets
+// a flag for editorRefreshScreen and writes to a pipe so that a poll
+// waiting for the terminal wakes up.
+void handleSigWinch(int sig) {
+	(void)sig;
+	int saved_errno = errno;
+	E.resized = 1;
+	if (write(E.winch_pipe[1], "", 1) == -1) {
+		// The pipe is full, a wakeup is pending anyway
+	}
+	errno = saved_errno;
+}
+
+void editorWatchResize(void) {
+	if (pipe(E.winch_pipe) == -1) die("pipe");
+	for (int i = 0; i < 2; i++)
+		fcntl(E.winch_pipe[i], F_SETFL, O_NONBLOCK);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handleSigWinch;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+}
+
+// Pick up a new terminal size. The shadow screen no longer matches it,
+// so the next frame is a full redraw, and editorScroll clamps rowoff and
+// coloff to the new size.
+void editorCheckResize(void) {
+	if (!E.resized) return;
+	E.resized = 0;
+
+	char buf[64];
+	while (read(E.winch_pipe[0], buf, sizeof(buf)) > 0);
+
+	if (getWindowSize(&E.screenrows, &E.screencols) == -1)
+		die("getWindowSize");
+	E.screenrows -= 2;  // reserved for status bar and message bar
+	E.redraw = 1;
+}
+
+// Read whatever input is available into E.inbuf. Returns the number of
+// bytes read.
+int editorFillInput(void) {
+	if (E.inpos == E.inlen) {
+		E.inpos = E.inlen = 0;
+	} else if (E.inpos > 0) {
+		memmove(E.inbuf, &E.inbuf[E.inpos], E.inlen - E.inpos);
+		E.inlen -= E.inpos;
+		E.inpos = 0;
+	}
+
+	ssize_t n = read(STDIN_FILENO, &E.inbuf[E.inlen],
+					 sizeof(E.inbuf) - E.inlen);
+	if (n == -1 && errno != EAGAIN && errno != EINTR) die("read");
+	if (n <= 0) return 0;
+	E.inlen += n;
+	return n;
+}
+
+int editorInputPending(void) {
+	return E.inpos < E.inlen;
+}
+
+// Milliseconds until the status message on screen expires, 0 if it
+// already has and -1 if none is shown
+int editorMessageTimeout(void) {
+	if (!E.statusmsg_drawn) return -1;
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	long long left = (long long)(E.statusmsg_time + STATUS_MESSAGE_SECONDS) * 1000
+					 - ((long long)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+	return left > 0 ? (int)left : 0;
+}
+
+// Run the event loop until more than have bytes of input are buffered.
+// While waiting, queued output is handed to the terminal, frames that
+// were dropped are drawn, the status message expires, resizes are picked
+// up, search results come in, saves make progress, the journal is synced
+// and background highlighting catches up.
+void editorWaitMore(int have) {
+	while (E.inlen - E.inpos <= have) {
+		editorCheckResize();
+		if (editorMessageTimeout() == 0) E.redraw = 1;
+		if (E.redraw && !editorOutputPending()) editorRefreshScreen();
+		journalUpdate();
+		if (E.bench.active && benchFeed()) continue;
+
+		struct pollfd pfd[5] = {
+			{ E.bench.active ? -1 : STDIN_FILENO, POLLIN, 0 },
+			{ E.winch_pipe[0], POLLIN, 0 },
+			{ editorOutputPending() ? E.outfd : -1, POLLOUT, 0 },
+			{ E.search.job.active ? E.search.wake_pipe[0] : -1, POLLIN, 0 },
+			{ E.save.active ? E.save.wake_pipe[0] : -1, POLLIN, 0 }
+		};
+		int timeout = editorSyntaxPending() ? 0 : editorMessageTimeout();
+		int due = journalTimeout();
+		if (due != -1 && (timeout == -1 || due < timeout)) timeout = due;
+		int n = poll(pfd, 5, timeout);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			die("poll");
+		}
+
+		if (pfd[2].revents) editorFlushOutput();
+		if (pfd[3].revents) editorSearchUpdate();
+		if (pfd[4].revents) editorSaveUpdate();
+		if (pfd[0].revents) {
+			// A hung up terminal stays readable without ever having input
+			if (editorFillInput() == 0 && (pfd[0].revents & (POLLHUP | POLLERR)))
+				die("read");
+		} else if (n == 0 && editorSyntaxPending()) {
+			if (editorSyntaxIdle()) E.redraw = 1;
+		}
+	}
+}
+
+void editorWaitInput(void) {
+	editorWaitMore(0);
+}
+
+// Next byte of an escape sequence, which arrives right after its ESC.
+// Returns 0 if nothing came in time.
+int editorReadSeqByte(char *c) {
+	if (!editorInputPending()) {
+		struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+		if (poll(&pfd, 1, ESC_SEQ_TIMEOUT_MS) <= 0 || editorFillInput() == 0)
+			return 0;
 	}
+	*c = E.inbuf[E.inpos++];
+	return 1;
+}
+
+int editorReadKey(void) {
+	editorWaitInput();
+	char c = E.inbuf[E.inpos++];
+
 	if (c == '\x1b') {
 		char seq[3];
 
-		if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-		if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+		if (!editorReadSeqByte(&seq[0])) return '\x1b';
+		if (!editorReadSeqByte(&seq[1])) return '\x1b';
 		
 		if (seq[0] == '[') {
 			if (seq[1] >= '0' && seq[1] <= '9') {
-				if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+				int n = seq[1] - '0';
+				do {
+					if (!editorReadSeqByte(&seq[2])) return '\x1b';
+					if (seq[2] >= '0' && seq[2] <= '9') n = n * 10 + seq[2] - '0';
+				} while (seq[2] >= '0' && seq[2] <= '9' && n < 1000);
 
 				if (seq[2] == '~') {
-					switch (seq[1]) {
-						case '1': return HOME_KEY;
-						case '3': return DEL_KEY;
-						case '4': return END_KEY;
-						case '5': return PAGE_UP;
-						case '6': return PAGE_DOWN;
-						case '7': return HOME_KEY;
-						case '8': return END_KEY;
+					switch (n) {
+						case 1: return HOME_KEY;
+						case 3: return DEL_KEY;
+						case 4: return END_KEY;
+						case 5: return PAGE_UP;
+						case 6: return PAGE_DOWN;
+						case 7: return HOME_KEY;
+						case 8: return END_KEY;
+						case 200: return PASTE_START;
 					}
 				}
 			} else {
@@ -246,6 +924,50 @@ int editorReadKey(void) {
 	}
 }
 
+// Collect the text of a bracketed paste after PASTE_START was read,
+// straight from the input buffer up to the end marker
+char *editorReadPaste(int *len) {
+	struct abuf paste = ABUF_INIT;
+	int held = 0;  // bytes that may be the start of the marker
+
+	while (1) {
+		editorWaitMore(held);
+		char *in = &E.inbuf[E.inpos];
+		int avail = E.inlen - E.inpos;
+
+		// Everything up to the marker, or up to what may be its start
+		int take = 0;
+		while (take < avail) {
+			char *esc = memchr(&in[take], '\x1b', avail - take);
+			if (esc == NULL) {
+				take = avail;
+				break;
+			}
+			int left = avail - (esc - in);
+			int cmp = left < PASTE_END_LEN ? left : PASTE_END_LEN;
+			if (memcmp(esc, PASTE_END, cmp) == 0) {
+				take = esc - in;
+				break;
+			}
+			take = esc - in + 1;
+		}
+		abAppend(&paste, in, take);
+		E.inpos += take;
+
+		if (E.inlen - E.inpos >= PASTE_END_LEN) {
+			E.inpos += PASTE_END_LEN;
+			break;
+		}
+		// Only part of the marker may be here. It is held, however long
+		// the rest takes, until more input completes it or shows that it
+		// was not the marker.
+		held = E.inlen - E.inpos;
+	}
+
+	*len = paste.len;
+	return paste.b;
+}
+
 int getCursorPosition(int *rows, int *cols) {
 	char buf[32];
 	unsigned int i = 0;
@@ -273,6 +995,12 @@ int getCursorPosition(int *rows, int *cols) {
 int getWindowSize(int *rows, int *cols) {
 	struct winsize ws;
 
+	if (E.bench.active) {
+		*rows = E.bench.rows;
+		*cols = E.bench.cols;
+		return 0;
+	}
+
 	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
 		if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
 			return -1;
@@ -285,472 +1013,4110 @@ int getWindowSize(int *rows, int *cols) {
 	}
 }
 
-/* syntax highlighting */
-
-int is_separator(int c) {
-	return isspace(c) || c == '\0' || strchr("\"',.()+-/*=~%<>[]{};", c) != NULL;
+/* row storage
+ *
+ * The rows are split into pages, each with a row tree of its own. A file
+ * normally is a single page that is loaded when it is opened. Files
+ * bigger than cfg.page_memory are opened paged instead: one pass over the
+ * mapping cuts them into ROWPAGE_BYTES pages at line boundaries and counts
+ * their rows, and a page only gets its row tree once one of its rows is
+ * looked at. Loaded pages are kept in LRU order and the least recently
+ * used ones that were not edited are unloaded again between keys, so
+ * only what is looked at and what was edited takes memory. Fenwick trees
+ * over the pages' row counts and sizes find the page of a row or of a
+ * byte offset in O(log pages). */
+
+#define ROW_LEAF(n) ((struct rowLeaf *)(n))
+#define ROW_INNER(n) ((struct rowInner *)(n))
+
+struct rowNode *rowNodeNew(int leaf, int page) {
+	struct rowNode *node = calloc(1, leaf ? sizeof(struct rowLeaf)
+										 : sizeof(struct rowInner));
+	if (node == NULL) die("calloc");
+	node->leaf = leaf;
+	node->page = page;
+	node->epoch = E.epoch;
+	return node;
 }
 
-void editorUpdateSyntax(erow *row) {
-	row->hl = realloc(row->hl, row->rsize);
-	memset(row->hl, HL_NORMAL, row->rsize);
+// Called before a node changes while a save may still be writing it.
+// The writer walks the row trees as they were when the save started, so
+// a node of those is copied before its first change and the copy takes
+// its place there, while the node and pointers to its rows stay valid.
+// A node learns its slot in the saved tree when its parent is copied,
+// before it can move to another parent. Only n, the children and the
+// chars and size of rows are kept as they were: the writer reads
+// nothing else.
+void rowNodeTouch(struct rowNode *node) {
+	struct saveJob *job = &E.save;
+	if (!job->active || node->epoch > job->epoch || job->pages[node->page].root == NULL)
+		return;
 
-	if (E.syntax == NULL) return;
+	if (node->slot_epoch != E.epoch) {
+		if (node->parent) {
+			rowNodeTouch(node->parent);
+		} else {
+			node->slot = &job->pages[node->page].root;
+			node->slot_epoch = E.epoch;
+		}
+	}
 
-	char **keywords = E.syntax->keywords;
+	size_t size = node->leaf ? sizeof(struct rowLeaf) : sizeof(struct rowInner);
+	struct rowNode *copy = malloc(size);
+	if (copy == NULL) die("malloc");
+	memcpy(copy, node, size);
+	if (job->ncopies == job->copies_cap) {
+		job->copies_cap = job->copies_cap ? job->copies_cap * 2 : 64;
+		job->copies = realloc(job->copies, sizeof(struct rowNode *) * job->copies_cap);
+		if (job->copies == NULL) die("realloc");
+	}
+	job->copies[job->ncopies++] = copy;
 
-	char *scs = E.syntax->singleline_comment_start;
-	char *mcs = E.syntax->multiline_comment_start;
-	char *mce = E.syntax->multiline_comment_end;
+	if (!node->leaf) {
+		for (int i = 0; i < node->n; i++) {
+			struct rowNode *child = ROW_INNER(node)->child[i];
+			child->slot = &ROW_INNER(copy)->child[i];
+			child->slot_epoch = E.epoch;
+		}
+	}
+	pthread_mutex_lock(&job->lock);
+	*node->slot = copy;
+	pthread_mutex_unlock(&job->lock);
+	node->epoch = E.epoch;
+}
 
-	int scs_len = scs ? strlen(scs) : 0;
-	int mcs_len = mcs ? strlen(mcs) : 0;
-	int mce_len = mce ? strlen(mce) : 0;
+// Position of a node among its parent's children
+int rowNodeSlot(struct rowNode *node) {
+	struct rowInner *parent = ROW_INNER(node->parent);
+	int i = 0;
+	while (parent->child[i] != node) i++;
+	return i;
+}
 
-	int prev_sep = 1;
-	int in_string = 0;
-	int in_comment = (row->idx > 0 && E.row[row->idx -1].hl_open_comment);
+void rowInnerInsertChild(struct rowInner *parent, int slot,
+						 struct rowNode *child) {
+	rowNodeTouch(&parent->node);
+	memmove(&parent->child[slot + 1], &parent->child[slot],
+			sizeof(struct rowNode *) * (parent->node.n - slot));
+	parent->child[slot] = child;
+	parent->node.n++;
+	child->parent = &parent->node;
+}
 
-	int i = 0;
-	while (i < row->rsize) {
-		char c = row->render[i];
-		unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-		
-		if (scs_len && !in_string && !in_comment) {
-			if (!strncmp(&row->render[i], scs, scs_len)) {
-				memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-				break;
-			}
-		}
+void rowInnerRemoveChild(struct rowInner *parent, int slot) {
+	rowNodeTouch(&parent->node);
+	memmove(&parent->child[slot], &parent->child[slot + 1],
+			sizeof(struct rowNode *) * (parent->node.n - slot - 1));
+	parent->node.n--;
+}
 
-		if (mcs_len && mce_len && !in_string) {
-			if (in_comment) {
-				row->hl[i] = HL_MLCOMMENT;
-				if (!strncmp(&row->render[i], mce, mce_len)) {
-					memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-					i+= mce_len;
-					in_comment = 0;
-					prev_sep = 1;
-					continue;
-				} else {
-					i++;
-					continue;
-				}
-			} else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-				memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-				i += mcs_len;
-				in_comment = 1;
-				continue;
-			}
+// Move the slots from half on of a full node into a new right sibling.
+// The parent must have room for one more child, a new root is made if
+// there is none.
+void rowNodeSplit(struct rowNode *node, int half) {
+	rowNodeTouch(node);
+	struct rowNode *right = rowNodeNew(node->leaf, node->page);
+	int moved = node->n - half;
+
+	if (node->leaf) {
+		erow *src = &ROW_LEAF(node)->rows[half];
+		memcpy(ROW_LEAF(right)->rows, src, sizeof(erow) * moved);
+		for (int i = 0; i < moved; i++) {
+			ROW_LEAF(right)->rows[i].leaf = right;
+			right->bytes += src[i].size + 1;
 		}
-
-		if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-			if (in_string) {
-				row->hl[i] = HL_STRING;
-				if (c == '\\' && i + 1 < row->rsize) {
-					row->hl[i + 1] = HL_STRING;
-					i += 2;
-					continue;
-				}
-				if (c == in_string) in_string = 0;
-				i++;
-				prev_sep = 1;
-				continue;
-			} else {
-				if (c == '"' || c == '\'') {
-					in_string = c;
-					row->hl[i] = HL_STRING;
-					i++;
-					continue;
-				}
-			}
+		right->count = moved;
+	} else {
+		struct rowNode **src = &ROW_INNER(node)->child[half];
+		memcpy(ROW_INNER(right)->child, src, sizeof(struct rowNode *) * moved);
+		for (int i = 0; i < moved; i++) {
+			ROW_INNER(right)->child[i]->parent = right;
+			right->count += ROW_INNER(right)->child[i]->count;
+			right->bytes += ROW_INNER(right)->child[i]->bytes;
 		}
+	}
+	right->n = moved;
+	node->n = half;
+
+	if (node->parent == NULL) {
+		struct rowNode *root = rowNodeNew(0, node->page);
+		root->count = node->count;
+		root->bytes = node->bytes;
+		rowInnerInsertChild(ROW_INNER(root), 0, node);
+		E.pages[node->page].root = root;
+	}
+	node->count -= right->count;
+	node->bytes -= right->bytes;
+	rowInnerInsertChild(ROW_INNER(node->parent), rowNodeSlot(node) + 1, right);
+}
 
-		if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-			if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || 
-				(c == '.' && prev_hl == HL_NUMBER)) {
-				row->hl[i] = HL_NUMBER;
-				i++;
-				prev_sep = 0;
-				continue;
-			}
+// Fold node b into its left neighbour a
+void rowNodeMerge(struct rowNode *a, struct rowNode *b) {
+	rowNodeTouch(a);
+	rowNodeTouch(b);
+	if (a->leaf) {
+		memcpy(&ROW_LEAF(a)->rows[a->n], ROW_LEAF(b)->rows, sizeof(erow) * b->n);
+		for (int i = 0; i < b->n; i++) ROW_LEAF(a)->rows[a->n + i].leaf = a;
+	} else {
+		for (int i = 0; i < b->n; i++) {
+			ROW_INNER(a)->child[a->n + i] = ROW_INNER(b)->child[i];
+			ROW_INNER(b)->child[i]->parent = a;
 		}
+	}
+	a->n += b->n;
+	a->count += b->count;
+	a->bytes += b->bytes;
+}
 
-		if (prev_sep) {
-			int j;
-			for (j = 0; keywords[j]; j++) {
-				// Checking primary or secondary keyword
-				int klen = strlen(keywords[j]);
-				int kw2 = keywords[j][klen - 1] == '|';
-				if (kw2) klen--;
+// Where to split a full node that is about to get a slot at pos. Nodes
+// that are only appended to, like while a file is loaded, are left full.
+int rowSplitPoint(struct rowNode *node, int pos) {
+	return pos == node->count ? node->n - 1 : node->n / 2;
+}
 
-				if (!strncmp(&row->render[i], keywords[j], klen) &&
-					is_separator(row->render[i + klen])) {
-					memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-					i+= klen;
-					break;
-				}
-			}
-			if (keywords[j] != NULL) {
-				prev_sep = 0;
-				continue;
-			}
+// Insert an empty row slot so that it ends up at index at of the page.
+// Full nodes are split on the way down so that there is always room in
+// the parent.
+erow *rowNodeInsert(struct rowPage *pg, int at) {
+	if (pg->root->n == ROWTREE_FANOUT) rowNodeSplit(pg->root, rowSplitPoint(pg->root, at));
+
+	struct rowNode *node = pg->root;
+	while (!node->leaf) {
+		struct rowInner *in = ROW_INNER(node);
+		int i = 0;
+		if (at == node->count) {
+			i = node->n - 1;
+			at -= node->count - in->child[i]->count;
+		} else {
+			while (i < node->n - 1 && at > in->child[i]->count)
+				at -= in->child[i++]->count;
 		}
 
-		prev_sep = is_separator(c);
-		i++;
+		if (in->child[i]->n == ROWTREE_FANOUT) {
+			rowNodeSplit(in->child[i], rowSplitPoint(in->child[i], at));
+			if (at > in->child[i]->count) at -= in->child[i++]->count;
+		}
+		node->count++;
+		node = in->child[i];
 	}
 
-	int changed = (row->hl_open_comment != in_comment);
-	row->hl_open_comment = in_comment;
-	if (changed && row->idx + 1 < E.numrows) {
-		editorUpdateSyntax(&E.row[row->idx + 1]);
-	}
+	rowNodeTouch(node);
+	erow *rows = ROW_LEAF(node)->rows;
+	memmove(&rows[at + 1], &rows[at], sizeof(erow) * (node->n - at));
+	node->n++;
+	node->count++;
+
+	memset(&rows[at], 0, sizeof(erow));
+	rows[at].leaf = node;
+	return &rows[at];
 }
 
-int editorSyntaxToColor(int hl) {
-	switch(hl) {
-		case HL_COMMENT: 
-		case HL_MLCOMMENT: return 36;
-		case HL_KEYWORD1: return 33;
-		case HL_KEYWORD2: return 32;
-		case HL_STRING: return 35;
-		case HL_NUMBER: return 31;
-		case HL_MATCH: return 34;
-		default: return 37;
+// Rows are inserted empty and must be emptied with rowTreeAddBytes before
+// they are removed, so that the byte counts stay right
+void rowNodeRemove(struct rowPage *pg, int at) {
+	struct rowNode *node = pg->root;
+	while (!node->leaf) {
+		struct rowInner *in = ROW_INNER(node);
+		int i = 0;
+		while (i < node->n - 1 && at >= in->child[i]->count)
+			at -= in->child[i++]->count;
+		node->count--;
+		node = in->child[i];
 	}
-}
 
-void editorSelectSyntaxHighlight(void) {
-	E.syntax = NULL;
-	if (E.filename == NULL) return;
+	rowNodeTouch(node);
+	erow *rows = ROW_LEAF(node)->rows;
+	memmove(&rows[at], &rows[at + 1], sizeof(erow) * (node->n - at - 1));
+	node->n--;
+	node->count--;
+
+	// Merge underfull nodes with a neighbour so the tree stays shallow
+	while (node->parent) {
+		struct rowInner *parent = ROW_INNER(node->parent);
+		int slot = rowNodeSlot(node);
+		if (node->n == 0) {
+			rowInnerRemoveChild(parent, slot);
+			free(node);
+			node = &parent->node;
+			continue;
+		}
+		if (node->n >= ROWTREE_MIN_FILL) break;
+
+		int left = slot > 0 ? slot - 1 : slot;
+		if (left + 1 >= parent->node.n) break;
+		struct rowNode *a = parent->child[left];
+		struct rowNode *b = parent->child[left + 1];
+		if (a->n + b->n > ROWTREE_FANOUT) break;
+
+		rowNodeMerge(a, b);
+		rowInnerRemoveChild(parent, left + 1);
+		free(b);
+		node = &parent->node;
+	}
 
-	char *ext = strrchr(E.filename, '.');
+	if (!pg->root->leaf && pg->root->n == 0) {
+		rowNodeTouch(pg->root);
+		free(pg->root);
+		pg->root = rowNodeNew(1, pg - E.pages);
+	}
+	while (!pg->root->leaf && pg->root->n == 1) {
+		struct rowNode *child = ROW_INNER(pg->root)->child[0];
+		rowNodeTouch(pg->root);
+		free(pg->root);
+		child->parent = NULL;
+		pg->root = child;
+	}
+}
 
-	for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-		struct editorSyntax *s = &HLDB[j];
-		unsigned int i = 0;
-		while (s->filematch[i]) {
-			int is_ext = (s->filematch[i][0] == '.');
-			if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-				(!is_ext && strstr(E.filename, s->filematch[i]))) {
-				E.syntax = s;
-				int filerow;
-				for (filerow = 0; filerow < E.numrows; filerow++) {
-					editorUpdateSyntax(&E.row[filerow]);
-				}
-				
-				return;
-			}
-			i++;
+void rowNodeFree(struct rowNode *node) {
+	if (node->leaf) {
+		for (int i = 0; i < node->n; i++) {
+			erow *row = &ROW_LEAF(node)->rows[i];
+			editorRowFreeRender(row);
+			if (!row->mapped) free(row->chars);
+			free(row->hl);
 		}
+	} else {
+		for (int i = 0; i < node->n; i++) rowNodeFree(ROW_INNER(node)->child[i]);
 	}
+	free(node);
 }
 
-/* row operations */
+// Pages
 
-int editorRowCxToRx(erow *row, int cx) {
-	int rx = 0;
-	int j;
-	for (j = 0; j < cx; j++) {
-		if (row->chars[j] == '\t')
-			rx += (cfg.tab_stop - 1) - (rx % cfg.tab_stop);
-		rx++;
+void pageIndexAdd(int p, int lines, long long bytes) {
+	for (int i = p + 1; i <= E.npages; i += i & -i) {
+		E.page_lines[i] += lines;
+		E.page_bytes[i] += bytes;
 	}
-	return rx;
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-	int cur_rx = 0;
-	int cx;
-	for (cx = 0; cx < row->size; cx++) {
-		if (row->chars[cx] == '\t')
-			cur_rx += (cfg.tab_stop - 1) - (cur_rx % cfg.tab_stop);
-		cur_rx++;
+// Rows and bytes of the pages before page p
+int pageLinesBefore(int p, long long *bytes) {
+	int lines = 0;
+	*bytes = 0;
+	for (int i = p; i > 0; i -= i & -i) {
+		lines += E.page_lines[i];
+		*bytes += E.page_bytes[i];
+	}
+	return lines;
+}
 
-		if (cur_rx > rx) return cx;
+// Page that holds row *at, which is made an index into that page
+int pageFindLine(int *at) {
+	int p = 0;
+	int step = 1;
+	while (step * 2 <= E.npages) step *= 2;
+	for (; step; step /= 2) {
+		if (p + step <= E.npages && E.page_lines[p + step] <= *at) {
+			p += step;
+			*at -= E.page_lines[p];
+		}
 	}
-	return cx;
+	return p;
 }
 
-void editorUpdateRow(erow *row) {
-	int tabs = 0;
-	int j;
-	for (j = 0; j < row->size; j++)
-		if (row->chars[j] == '\t') tabs++;
+// Page that holds byte *off, which is made an offset into that page
+int pageFindByte(long long *off) {
+	int p = 0;
+	int step = 1;
+	while (step * 2 <= E.npages) step *= 2;
+	for (; step; step /= 2) {
+		if (p + step <= E.npages && E.page_bytes[p + step] <= *off) {
+			p += step;
+			*off -= E.page_bytes[p];
+		}
+	}
+	return p;
+}
 
-	free(row->render);
-	row->render = malloc(row->size + tabs*(cfg.tab_stop - 1) + 1);
+// Set up the page table, the Fenwick trees are built from the pages'
+// count and bytes
+void pageTableInit(struct rowPage *pages, int npages) {
+	for (int i = 0; i < E.npages; i++)
+		if (E.pages[i].root) rowNodeFree(E.pages[i].root);
+	free(E.pages);
+	free(E.page_lines);
+	free(E.page_bytes);
+
+	E.pages = pages;
+	E.npages = npages;
+	E.page_lines = calloc(npages + 1, sizeof(int));
+	E.page_bytes = calloc(npages + 1, sizeof(long long));
+	E.lru_head = E.lru_tail = -1;
+	E.page_resident = 0;
+	for (int p = 0; p < npages; p++) {
+		pages[p].root = NULL;
+		pages[p].dirty = 0;
+		pageIndexAdd(p, pages[p].count, pages[p].bytes);
+	}
+}
 
-	// Copy the content of row to render
-	int idx = 0;
-	for (j = 0; j < row->size; j++) {
-		if (row->chars[j] == '\t') {
-			row->render[idx++] = ' ';
-			while (idx % cfg.tab_stop != 0) row->render[idx++] = ' ';
-		} else {
-		row->render[idx++] = row->chars[j];
+void pageUnlink(int p) {
+	struct rowPage *pg = &E.pages[p];
+	if (pg->lru_prev != -1) E.pages[pg->lru_prev].lru_next = pg->lru_next;
+	else E.lru_head = pg->lru_next;
+	if (pg->lru_next != -1) E.pages[pg->lru_next].lru_prev = pg->lru_prev;
+	else E.lru_tail = pg->lru_prev;
+}
+
+// Make sure the page has its rows and mark it as most recently used
+void pageLoad(struct rowPage *pg) {
+	int p = pg - E.pages;
+	if (pg->root) {
+		if (E.lru_head == p) return;
+		pageUnlink(p);
+	} else {
+		pg->root = rowNodeNew(1, p);
+		char *s = E.map + pg->offset;
+		char *end = s + pg->len;
+		int at = 0;
+		while (s < end) {
+			char *nl = memchr(s, '\n', end - s);
+			char *next = nl ? nl + 1 : end;
+			if (nl == NULL) nl = end;
+
+			int linelen = nl - s;
+			while (linelen > 0 && s[linelen - 1] == '\r') linelen--;
+			erow *row = rowNodeInsert(pg, at++);
+			row->size = linelen;
+			row->chars = s;
+			row->mapped = 1;
+			row->epoch = E.epoch;
+			row->stale = 1;
+			row->damaged = 1;
+			row->hl_in = -1;
+			for (struct rowNode *node = row->leaf; node; node = node->parent)
+				node->bytes += linelen + 1;
+			s = next;
 		}
+		pg->cost = sizeof(erow) * pg->count + pg->len;
+		E.page_resident += pg->cost;
 	}
-	row->render[idx] = '\0';  // null terminator
-	row->rsize = idx;
 
-	editorUpdateSyntax(row);
+	pg->lru_prev = -1;
+	pg->lru_next = E.lru_head;
+	if (E.lru_head != -1) E.pages[E.lru_head].lru_prev = p;
+	E.lru_head = p;
+	if (E.lru_tail == -1) E.lru_tail = p;
+}
+
+// Let the kernel drop the memory pages that lie within len bytes of the
+// mapping at off. They are read from the file again when touched.
+void mapDrop(long long off, long long len) {
+	long pagesize = sysconf(_SC_PAGESIZE);
+	long long from = (off + pagesize - 1) / pagesize * pagesize;
+	long long to = (off + len) / pagesize * pagesize;
+	if (to > from) madvise(E.map + from, to - from, MADV_DONTNEED);
+}
+
+void pageUnload(struct rowPage *pg) {
+	pageUnlink(pg - E.pages);
+	rowNodeFree(pg->root);
+	pg->root = NULL;
+	E.page_resident -= pg->cost;
+	mapDrop(pg->offset, pg->len);
+}
+
+// After a save the file holds what the pages hold, unless it was edited
+// since. Map the saved file and point the pages into it, so the pages
+// that were edited can be unloaded again. All loaded pages are unloaded,
+// their rows point into the old mapping. Returns -1 and leaves the pages
+// as they are if the file is not what was saved.
+int editorRemapPages(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) return -1;
+
+	struct stat st;
+	long long size = 0;
+	for (int p = 0; p < E.npages; p++)
+		size += E.pages[p].dirty ? E.pages[p].bytes : E.pages[p].len;
+	if (fstat(fd, &st) == -1 || st.st_size != size || size == 0) {
+		close(fd);
+		return -1;
+	}
+
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return -1;
+	madvise(map, st.st_size, MADV_RANDOM);
+
+	while (E.lru_head != -1) pageUnload(&E.pages[E.lru_head]);
+	long long offset = 0;
+	for (int p = 0; p < E.npages; p++) {
+		struct rowPage *pg = &E.pages[p];
+		if (pg->dirty) pg->len = pg->bytes;
+		pg->offset = offset;
+		pg->dirty = 0;
+		offset += pg->len;
+	}
+	munmap(E.map, E.mapsize);
+	E.map = map;
+	E.mapsize = st.st_size;
+	return 0;
+}
+
+// Unload pages that were not edited, least recently used first, until
+// the loaded ones fit into cfg.page_memory. Row pointers into unloaded
+// pages go stale, so this only runs between keys.
+void editorTrimPages(void) {
+	// Never while a writer or search worker may still read the rows or
+	// the mapping
+	if (E.remap && !E.save.active && !E.search.job.active) {
+		E.remap = 0;
+		if (E.dirty == 0) editorRemapPages(E.filename);
+	}
+
+	long long budget = (long long)cfg.page_memory << 20;
+	int p = E.lru_tail;
+	while (E.page_resident > budget && p != -1) {
+		int prev = E.pages[p].lru_prev;
+		if (!E.pages[p].dirty) pageUnload(&E.pages[p]);
+		p = prev;
+	}
+}
+
+// Cut the mapped file into pages without loading any. Returns -1 with
+// errno set if it has more rows than an int can count or memory runs out.
+int editorIndexPages(void) {
+	int cap = E.mapsize / ROWPAGE_BYTES + 1;
+	struct rowPage *pages = calloc(cap, sizeof(struct rowPage));
+	if (pages == NULL) return -1;
+	int npages = 0;
+	long long rows = 0;
+	long long dropped = 0;
+
+	char *s = E.map;
+	char *end = E.map + E.mapsize;
+	while (s < end) {
+		struct rowPage *pg = &pages[npages++];
+		pg->offset = s - E.map;
+		char *stop = end - s > ROWPAGE_BYTES ? s + ROWPAGE_BYTES : end;
+		while (s < end) {
+			char *nl = memchr(s, '\n', end - s);
+			char *next = nl ? nl + 1 : end;
+			if (nl == NULL) nl = end;
+
+			long long linelen = nl - s;
+			while (linelen > 0 && s[linelen - 1] == '\r') linelen--;
+			pg->count++;
+			pg->bytes += linelen + 1;
+			s = next;
+			if (s >= stop) break;
+		}
+		pg->len = s - E.map - pg->offset;
+		rows += pg->count;
+		if (rows > INT_MAX) {
+			free(pages);
+			errno = EFBIG;
+			return -1;
+		}
+		if (npages == cap) {
+			struct rowPage *grown = realloc(pages, sizeof(struct rowPage) * cap * 2);
+			if (grown == NULL) {
+				free(pages);
+				return -1;
+			}
+			pages = grown;
+			cap *= 2;
+			memset(&pages[npages], 0, sizeof(struct rowPage) * (cap - npages));
+		}
+
+		// The index is all that is kept of the pass
+		long long done = s - E.map;
+		if (done - dropped >= 64 * ROWPAGE_BYTES) {
+			mapDrop(dropped, done - dropped);
+			dropped = done;
+		}
+	}
+	pageTableInit(pages, npages);
+	E.numrows = rows;
+	return 0;
+}
+
+// Rows are inserted and removed through the pages: a row between two
+// pages goes to the end of the first one
+
+erow *rowTreeInsert(int at) {
+	int p = 0;
+	if (at > 0) {
+		at--;
+		p = pageFindLine(&at);
+		at++;
+	}
+	struct rowPage *pg = &E.pages[p];
+	pageLoad(pg);
+	pg->dirty = 1;
+	pg->count++;
+	pageIndexAdd(p, 1, 0);
+	return rowNodeInsert(pg, at);
+}
+
+void rowTreeRemove(int at) {
+	int p = pageFindLine(&at);
+	struct rowPage *pg = &E.pages[p];
+	pageLoad(pg);
+	pg->dirty = 1;
+	pg->count--;
+	pageIndexAdd(p, -1, 0);
+	rowNodeRemove(pg, at);
+}
+
+// A row changed its size by delta bytes
+void rowTreeAddBytes(erow *row, long long delta) {
+	for (struct rowNode *node = row->leaf; node; node = node->parent)
+		node->bytes += delta;
+
+	struct rowPage *pg = &E.pages[row->leaf->page];
+	pg->dirty = 1;
+	pg->bytes += delta;
+	pageIndexAdd(row->leaf->page, 0, delta);
+}
+
+// Row access API, nothing outside this section should walk the tree
+
+// Row at of a loaded page. It does not mark the page as used, so other
+// threads can call it while the main thread does not edit.
+erow *pageRowAt(struct rowPage *pg, int at) {
+	struct rowNode *node = pg->root;
+	while (!node->leaf) {
+		struct rowInner *in = ROW_INNER(node);
+		int i = 0;
+		while (i < node->n - 1 && at >= in->child[i]->count)
+			at -= in->child[i++]->count;
+		node = in->child[i];
+	}
+	return &ROW_LEAF(node)->rows[at];
+}
+
+erow *editorRowAt(int at) {
+	if (at < 0 || at >= E.numrows) return NULL;
+
+	struct rowPage *pg = &E.pages[pageFindLine(&at)];
+	pageLoad(pg);
+	return pageRowAt(pg, at);
+}
+
+int editorRowIndex(erow *row) {
+	struct rowNode *node = row->leaf;
+	int idx = row - ROW_LEAF(node)->rows;
+	while (node->parent) {
+		struct rowInner *parent = ROW_INNER(node->parent);
+		for (int i = 0; parent->child[i] != node; i++)
+			idx += parent->child[i]->count;
+		node = node->parent;
+	}
+	long long bytes;
+	return pageLinesBefore(node->page, &bytes) + idx;
+}
+
+// Byte offset in the file at which the row at index at starts
+long long editorRowOffset(int at) {
+	long long off;
+	if (at >= E.numrows) {
+		pageLinesBefore(E.npages, &off);
+		return off;
+	}
+
+	int p = pageFindLine(&at);
+	pageLinesBefore(p, &off);
+	pageLoad(&E.pages[p]);
+	struct rowNode *node = E.pages[p].root;
+	while (!node->leaf) {
+		struct rowInner *in = ROW_INNER(node);
+		int i = 0;
+		while (i < node->n - 1 && at >= in->child[i]->count) {
+			at -= in->child[i]->count;
+			off += in->child[i++]->bytes;
+		}
+		node = in->child[i];
+	}
+	for (int i = 0; i < at; i++)
+		off += ROW_LEAF(node)->rows[i].size + 1;
+	return off;
+}
+
+// Index of the row that holds byte offset off, *start is set to where
+// that row starts. Offsets past the end give the last row.
+int editorOffsetRow(long long off, long long *start) {
+	*start = 0;
+	if (E.numrows == 0) return 0;
+	long long total;
+	pageLinesBefore(E.npages, &total);
+	if (off >= total) off = total - 1;
+
+	int p = pageFindByte(&off);
+	int at = pageLinesBefore(p, start);
+	pageLoad(&E.pages[p]);
+	struct rowNode *node = E.pages[p].root;
+	while (!node->leaf) {
+		struct rowInner *in = ROW_INNER(node);
+		int i = 0;
+		while (i < node->n - 1 && off >= in->child[i]->bytes) {
+			off -= in->child[i]->bytes;
+			*start += in->child[i]->bytes;
+			at += in->child[i++]->count;
+		}
+		node = in->child[i];
+	}
+	erow *rows = ROW_LEAF(node)->rows;
+	int i = 0;
+	while (i < node->n - 1 && off >= rows[i].size + 1) {
+		off -= rows[i].size + 1;
+		*start += rows[i++].size + 1;
+	}
+	return at + i;
+}
+
+// First or last row of the nearest page after or before page p that has
+// rows
+erow *pageEdgeRow(int p, int dir) {
+	for (p += dir; p >= 0 && p < E.npages; p += dir) {
+		struct rowPage *pg = &E.pages[p];
+		if (pg->count == 0) continue;
+		pageLoad(pg);
+		struct rowNode *node = pg->root;
+		while (!node->leaf) node = ROW_INNER(node)->child[dir > 0 ? 0 : node->n - 1];
+		return &ROW_LEAF(node)->rows[dir > 0 ? 0 : node->n - 1];
+	}
+	return NULL;
+}
+
+erow *editorRowNext(erow *row) {
+	struct rowNode *node = row->leaf;
+	if (row + 1 < &ROW_LEAF(node)->rows[node->n]) return row + 1;
+
+	while (node->parent) {
+		int slot = rowNodeSlot(node);
+		if (slot + 1 < node->parent->n) {
+			node = ROW_INNER(node->parent)->child[slot + 1];
+			while (!node->leaf) node = ROW_INNER(node)->child[0];
+			return &ROW_LEAF(node)->rows[0];
+		}
+		node = node->parent;
+	}
+	return pageEdgeRow(node->page, 1);
+}
+
+erow *editorRowPrev(erow *row) {
+	struct rowNode *node = row->leaf;
+	if (row > ROW_LEAF(node)->rows) return row - 1;
+
+	while (node->parent) {
+		int slot = rowNodeSlot(node);
+		if (slot > 0) {
+			node = ROW_INNER(node->parent)->child[slot - 1];
+			while (!node->leaf) node = ROW_INNER(node)->child[node->n - 1];
+			return &ROW_LEAF(node)->rows[node->n - 1];
+		}
+		node = node->parent;
+	}
+	return pageEdgeRow(node->page, -1);
+}
+
+/* syntax highlighting */
+
+// Whitespace, '\0' and "\"',.()+-/*=~%<>[]{};"
+static const unsigned char separator_table[256] = {
+	['\0'] = 1, [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1,
+	['\r'] = 1, ['"'] = 1, ['\''] = 1, [','] = 1, ['.'] = 1, ['('] = 1,
+	[')'] = 1, ['+'] = 1, ['-'] = 1, ['/'] = 1, ['*'] = 1, ['='] = 1,
+	['~'] = 1, ['%'] = 1, ['<'] = 1, ['>'] = 1, ['['] = 1, [']'] = 1,
+	['{'] = 1, ['}'] = 1, [';'] = 1
+};
+
+int is_separator(int c) {
+	return separator_table[(unsigned char)c];
+}
+
+unsigned int keywordHash(const char *s, int len, unsigned int seed) {
+	unsigned int h = seed ^ (unsigned int)len;
+	for (int i = 0; i < len; i++)
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	return h ^ (h >> 15);
+}
+
+// Place every keyword in its own slot, trying seeds and then bigger
+// tables until there is no collision. A keyword that appears twice keeps
+// its first class, like the linear scan did.
+void keywordTableCompile(struct syntaxTables *t, char **keywords) {
+	int n = 0;
+	t->pool_len = 0;
+	for (n = 0; keywords && keywords[n]; n++)
+		t->pool_len += strlen(keywords[n]);
+
+	t->pool = malloc(t->pool_len + 1);
+	if (t->pool == NULL) die("malloc");
+
+	unsigned int size = 8;
+	while (size < (unsigned int)n * 2) size *= 2;
+
+	for (;;) {
+		t->kw_slots = calloc(size, sizeof(struct keyword));
+		if (t->kw_slots == NULL) die("calloc");
+		t->kw_mask = size - 1;
+
+		for (t->kw_seed = 1; t->kw_seed <= 256; t->kw_seed++) {
+			memset(t->kw_slots, 0, size * sizeof(struct keyword));
+			t->kw_minlen = INT_MAX;
+			t->kw_maxlen = 0;
+
+			int off = 0;
+			int j;
+			for (j = 0; j < n; j++) {
+				int klen = strlen(keywords[j]);
+				int kw2 = keywords[j][klen - 1] == '|';
+				if (kw2) klen--;
+				if (klen == 0) continue;
+
+				unsigned int h = keywordHash(keywords[j], klen, t->kw_seed);
+				struct keyword *slot = &t->kw_slots[h & t->kw_mask];
+				if (slot->len) {
+					if (slot->len == klen &&
+						!memcmp(&t->pool[slot->off], keywords[j], klen))
+						continue;
+					break;
+				}
+				memcpy(&t->pool[off], keywords[j], klen);
+				slot->off = off;
+				slot->len = klen;
+				slot->hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+				off += klen;
+				if (klen < t->kw_minlen) t->kw_minlen = klen;
+				if (klen > t->kw_maxlen) t->kw_maxlen = klen;
+			}
+			if (j == n) return;
+		}
+		free(t->kw_slots);
+		size *= 2;
+	}
+}
+
+// Highlight class of the word, HL_NORMAL if it is not a keyword
+int keywordLookup(struct syntaxTables *t, const char *s, int len) {
+	if (len < t->kw_minlen || len > t->kw_maxlen) return HL_NORMAL;
+	unsigned int h = keywordHash(s, len, t->kw_seed);
+	struct keyword *slot = &t->kw_slots[h & t->kw_mask];
+	if (slot->len == len && !memcmp(&t->pool[slot->off], s, len))
+		return slot->hl;
+	return HL_NORMAL;
+}
+
+void syntaxCopyDelim(char *dst, int *len, const char *src) {
+	*len = 0;
+	if (src == NULL) return;
+	*len = strlen(src);
+	if (*len >= SYNTAX_DELIM_MAX) *len = SYNTAX_DELIM_MAX - 1;
+	memcpy(dst, src, *len);
+	dst[*len] = '\0';
+}
+
+// Turn a syntax description into the byte class tables, delimiters and
+// keyword hash that editorHighlight runs on
+void editorSyntaxCompile(struct editorSyntax *syntax) {
+	if (syntax->tables) return;
+
+	struct syntaxTables *t = calloc(1, sizeof(struct syntaxTables));
+	if (t == NULL) die("calloc");
+
+	for (int c = 0; c < 256; c++) {
+		int sep = separator_table[c];
+		if (syntax->separators)
+			sep = c == 0 || isspace(c) || strchr(syntax->separators, c);
+		if (sep) t->cls[c] |= SC_SEP;
+	}
+
+	if (syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+		for (int c = '0'; c <= '9'; c++) t->cls[c] |= SC_DIGIT;
+		t->cls['.'] |= SC_DOT;
+	}
+
+	if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
+		const char *q = syntax->quotes ? syntax->quotes : "\"'";
+		for (; *q; q++) {
+			t->quote[(unsigned char)*q] = 1;
+			t->cls[(unsigned char)*q] |= SC_TOKEN;
+		}
+	}
+
+	syntaxCopyDelim(t->scs, &t->scs_len, syntax->singleline_comment_start);
+	syntaxCopyDelim(t->mcs, &t->mcs_len, syntax->multiline_comment_start);
+	syntaxCopyDelim(t->mce, &t->mce_len, syntax->multiline_comment_end);
+	if (t->mcs_len == 0 || t->mce_len == 0) t->mcs_len = t->mce_len = 0;
+	if (t->scs_len) t->cls[(unsigned char)t->scs[0]] |= SC_TOKEN;
+	if (t->mcs_len) t->cls[(unsigned char)t->mcs[0]] |= SC_TOKEN;
+
+	keywordTableCompile(t, syntax->keywords);
+	syntax->tables = t;
+}
+
+// Highlight len bytes of text into hl, starting in the given lexer state.
+// Returns the state at the end of the text. One pass over the row driven
+// by the compiled byte classes of the current syntax.
+int editorHighlight(const char *text, int len, unsigned char *hl, int state) {
+	memset(hl, HL_NORMAL, len);
+
+	if (E.syntax == NULL) return 0;
+
+	struct syntaxTables *t = E.syntax->tables;
+	const unsigned char *cls = t->cls;
+
+	int prev_sep = 1;
+	int in_comment = t->mce_len ? state & HL_STATE_COMMENT : 0;
+	int in_string = t->quote[HL_STATE_QUOTE(state)] ? HL_STATE_QUOTE(state) : 0;
+	int continued = 0;  // string ends in '\\' and goes on in the next row
+
+	int i = 0;
+	while (i < len) {
+		unsigned char c = text[i];
+
+		if (in_comment) {
+			// Jump to the next byte that could end the comment
+			const char *end = memchr(&text[i], t->mce[0], len - i);
+			int j = end ? end - text : len;
+			memset(&hl[i], HL_MLCOMMENT, j - i);
+			i = j;
+			if (i == len) break;
+
+			if (i + t->mce_len <= len && !memcmp(&text[i], t->mce, t->mce_len)) {
+				memset(&hl[i], HL_MLCOMMENT, t->mce_len);
+				i += t->mce_len;
+				in_comment = 0;
+				prev_sep = 1;
+			} else {
+				hl[i++] = HL_MLCOMMENT;
+			}
+			continue;
+		}
+
+		if (in_string) {
+			hl[i] = HL_STRING;
+			if (c == '\\' && i + 1 < len) {
+				hl[i + 1] = HL_STRING;
+				i += 2;
+				continue;
+			}
+			if (c == '\\') continued = 1;
+			if (c == in_string) in_string = 0;
+			i++;
+			prev_sep = 1;
+			continue;
+		}
+
+		int cl = cls[c];
+
+		if (cl & SC_TOKEN) {
+			if (t->scs_len && i + t->scs_len <= len &&
+				!memcmp(&text[i], t->scs, t->scs_len)) {
+				memset(&hl[i], HL_COMMENT, len - i);
+				break;
+			}
+			if (t->mcs_len && i + t->mcs_len <= len &&
+				!memcmp(&text[i], t->mcs, t->mcs_len)) {
+				memset(&hl[i], HL_MLCOMMENT, t->mcs_len);
+				i += t->mcs_len;
+				in_comment = 1;
+				continue;
+			}
+			if (t->quote[c]) {
+				in_string = c;
+				hl[i++] = HL_STRING;
+				continue;
+			}
+		}
+
+		if (cl & (SC_DIGIT | SC_DOT)) {
+			unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
+			if (((cl & SC_DIGIT) && (prev_sep || prev_hl == HL_NUMBER)) ||
+				((cl & SC_DOT) && prev_hl == HL_NUMBER)) {
+				hl[i++] = HL_NUMBER;
+				prev_sep = 0;
+				continue;
+			}
+		}
+
+		if (prev_sep) {
+			// A keyword is a whole word, so measure the word up to the
+			// next separator (at most one past the longest keyword)
+			int klen = 0;
+			while (klen <= t->kw_maxlen && i + klen < len &&
+				   !(cls[(unsigned char)text[i + klen]] & SC_SEP))
+				klen++;
+
+			int kwhl = keywordLookup(t, &text[i], klen);
+			if (kwhl != HL_NORMAL) {
+				memset(&hl[i], kwhl, klen);
+				i += klen;
+				prev_sep = 0;
+				continue;
+			}
+		}
+
+		prev_sep = cl & SC_SEP;
+		i++;
+	}
+
+	state = in_comment ? HL_STATE_COMMENT : 0;
+	if (in_string && continued) state |= HL_STATE_STRING(in_string);
+	return state;
+}
+
+// Replace the spans of row with the runs of the per-byte classes in hl
+void editorEncodeSpans(erow *row, const unsigned char *hl, int len) {
+	static struct hlSpan *spans = NULL;
+	static int spans_cap = 0;
+	int n = 0;
+
+	for (int i = 0; i < len;) {
+		int j = i + 1;
+		while (j < len && hl[j] == hl[i] && j - i < HL_SPAN_MAXLEN) j++;
+		if (hl[i] != HL_NORMAL) {
+			if (n == spans_cap) {
+				spans_cap = spans_cap ? spans_cap * 2 : 64;
+				spans = realloc(spans, sizeof(struct hlSpan) * spans_cap);
+			}
+			spans[n].start = i;
+			spans[n].len = j - i;
+			spans[n].hl = hl[i];
+			n++;
+		}
+		i = j;
+	}
+
+	if (n == row->hl_nspans &&
+		(n == 0 || memcmp(row->hl, spans, sizeof(struct hlSpan) * n) == 0))
+		return;
+	row->damaged = 1;
+
+	if (n != row->hl_nspans) {
+		if (n == 0) {
+			free(row->hl);
+			row->hl = NULL;
+		} else {
+			row->hl = realloc(row->hl, sizeof(struct hlSpan) * n);
+		}
+		row->hl_nspans = n;
+	}
+	if (n) memcpy(row->hl, spans, sizeof(struct hlSpan) * n);
+}
+
+// Re-lex a row with the given incoming state. Rows with a materialized
+// render get their spans rebuilt, others are only scanned for their
+// outgoing state.
+void editorUpdateSyntax(erow *row, int state) {
+	static unsigned char *scratch = NULL;
+	static int scratch_cap = 0;
+
+	int render = row->render && !row->stale;
+	int len = render ? row->rsize : row->size;
+	if (scratch == NULL || len > scratch_cap) {
+		scratch_cap = len * 2 + 1;
+		scratch = realloc(scratch, scratch_cap);
+	}
+
+	if (render) {
+		row->hl_state = editorHighlight(row->render, len, scratch, state);
+		editorEncodeSpans(row, scratch, len);
+	} else {
+		row->hl_state = editorHighlight(row->chars, len, scratch, state);
+	}
+	row->hl_in = state;
+}
+
+/* Incremental re-highlighting
+ *
+ * Every row remembers the state it was lexed with (hl_in) and the state
+ * it ended in (hl_state). A row is consistent when its hl_in equals the
+ * hl_state of the row above. Rows that may be inconsistent are kept in
+ * E.hl_pending: every inconsistent row is pending or follows a pending
+ * row through a run of inconsistent rows, so every row before the first
+ * pending one is known to be correct. Lexing a row makes the next one
+ * pending only if it does not fit the new outgoing state, so a change
+ * ripples down until a row ends in the same state as before. A freshly
+ * loaded file is one such run that starts at row 0. The ripple is
+ * worked off in bounded steps, the visible rows first and the rest
+ * while waiting for input. */
+
+void editorSyntaxMark(int at) {
+	// Paged files are only lexed where they are drawn, the ripple would
+	// load every page
+	if (E.paged) return;
+	if (at < 0 || at >= E.numrows) return;
+
+	int lo = 0, hi = E.hl_npending;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (E.hl_pending[mid] < at) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo < E.hl_npending && E.hl_pending[lo] == at) return;
+
+	if (E.hl_npending == E.hl_pending_cap) {
+		E.hl_pending_cap = E.hl_pending_cap ? E.hl_pending_cap * 2 : 16;
+		E.hl_pending = realloc(E.hl_pending, sizeof(int) * E.hl_pending_cap);
+	}
+	memmove(&E.hl_pending[lo + 1], &E.hl_pending[lo],
+			sizeof(int) * (E.hl_npending - lo));
+	E.hl_pending[lo] = at;
+	E.hl_npending++;
+}
+
+// Keep pending rows pointing at the same rows after rows were inserted
+// (delta > 0) or deleted (delta < 0) after index at
+void editorSyntaxShift(int at, int delta) {
+	int j = 0;
+	for (int i = 0; i < E.hl_npending; i++) {
+		int row = E.hl_pending[i];
+		if (row > at) row += delta;
+		if (j > 0 && E.hl_pending[j - 1] >= row) continue;
+		E.hl_pending[j++] = row;
+	}
+	E.hl_npending = j;
+}
+
+// First row whose lexer state is not known to be correct
+int editorSyntaxFrontier(void) {
+	return E.hl_npending ? E.hl_pending[0] : E.numrows;
+}
+
+// Lex a row and queue the next one if it no longer fits the state this
+// row hands on
+void editorSyntaxLex(erow *row, int at, int state) {
+	editorUpdateSyntax(row, state);
+	erow *next = editorRowNext(row);
+	if (next && next->hl_in != row->hl_state) editorSyntaxMark(at + 1);
+}
+
+// Work off pending rows before at, lexing at most budget rows. Returns
+// the number of rows lexed.
+int editorSyntaxAdvance(int at, int budget) {
+	int lexed = 0;
+	erow *row = NULL;
+	int row_at = -1;
+
+	while (E.hl_npending && E.hl_pending[0] < at && lexed < budget) {
+		int p = E.hl_pending[0];
+		memmove(&E.hl_pending[0], &E.hl_pending[1],
+				sizeof(int) * --E.hl_npending);
+
+		// Pending rows are usually resolved in order, step instead of seek
+		row = (row && row_at + 1 == p) ? editorRowNext(row) : editorRowAt(p);
+		row_at = p;
+		if (row == NULL) continue;
+
+		erow *prev = editorRowPrev(row);
+		int state = prev ? prev->hl_state : 0;
+		if (row->hl_in != state) {
+			editorSyntaxLex(row, p, state);
+			lexed++;
+		}
+	}
+	return lexed;
+}
+
+// One bounded step of background highlighting. Returns 1 if it went
+// over rows that are on screen.
+int editorSyntaxIdle(void) {
+	int from = editorSyntaxFrontier();
+	editorSyntaxAdvance(E.numrows, TEXTOPRAK_HL_BUDGET);
+	int to = editorSyntaxFrontier();
+	return from < E.rowoff + E.screenrows && to > E.rowoff;
+}
+
+int editorSyntaxPending(void) {
+	return E.hl_npending > 0;
+}
+
+int editorSyntaxToColor(int hl) {
+	switch(hl) {
+		case HL_COMMENT: 
+		case HL_MLCOMMENT: return 36;
+		case HL_KEYWORD1: return 33;
+		case HL_KEYWORD2: return 32;
+		case HL_STRING: return 35;
+		case HL_NUMBER: return 31;
+		case HL_MATCH: return 34;
+		default: return 37;
+	}
+}
+
+// Throw away all highlighting, rows are re-lexed when next drawn
+void editorSyntaxReset(void) {
+	erow *row;
+	for (row = editorRowAt(0); row; row = editorRowNext(row)) {
+		row->stale = 1;
+		row->hl_in = -1;
+	}
+	E.hl_npending = 0;
+	editorSyntaxMark(0);
+}
+
+void editorSelectSyntaxHighlight(void) {
+	E.syntax = NULL;
+	editorSyntaxReset();
+	if (E.filename == NULL) return;
+
+	char *ext = strrchr(E.filename, '.');
+
+	// Loaded definition files come first so they can override built-ins
+	for (int j = 0; j < E.nsyntaxes + (int)HLDB_ENTRIES; j++) {
+		struct editorSyntax *s = j < E.nsyntaxes ? E.syntaxes[j]
+												 : &HLDB[j - E.nsyntaxes];
+		unsigned int i = 0;
+		while (s->filematch[i]) {
+			int is_ext = (s->filematch[i][0] == '.');
+			if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+				(!is_ext && strstr(E.filename, s->filematch[i]))) {
+				E.syntax = s;
+				editorSyntaxCompile(s);
+				editorSyntaxReset();
+				return;
+			}
+			i++;
+		}
+	}
+}
+
+/* syntax files */
+
+// Languages can be added without recompiling by dropping a *.syntax file
+// into cfg.syntax_dir. Each line is "key = value", '#' starts a comment
+// and list values are separated by spaces:
+//
+//   filetype = c
+//   match = .c .h .cpp
+//   keywords = switch if while for
+//   keywords2 = int long char
+//   comment = //
+//   multiline_comment = /* */
+//   strings = " '
+//   numbers = 1
+//   separators = ,.()+-/*=~%<>[]{};
+//
+// Compiled tables of all files are kept in syntax.cache in the same
+// directory and reused until a file is added, removed or modified.
+
+#define SYNTAX_FILE_SUFFIX ".syntax"
+#define SYNTAX_CACHE_FILENAME "syntax.cache"
+#define SYNTAX_CACHE_MAGIC "TXSYN001"
+
+struct syntaxFile {
+	char *name;
+	long long size;
+	long long mtime_sec;
+	long long mtime_nsec;
+};
+
+char *syntaxTrim(char *s) {
+	while (isspace((unsigned char)*s)) s++;
+	char *end = s + strlen(s);
+	while (end > s && isspace((unsigned char)end[-1])) end--;
+	*end = '\0';
+	return s;
+}
+
+// Append the space separated words of value to a NULL terminated list
+char **syntaxAppendWords(char **list, char *value, const char *suffix) {
+	int n = 0;
+	while (list && list[n]) n++;
+
+	for (char *w = strtok(value, " \t"); w; w = strtok(NULL, " \t")) {
+		list = realloc(list, sizeof(char *) * (n + 2));
+		list[n] = malloc(strlen(w) + strlen(suffix) + 1);
+		strcpy(list[n], w);
+		strcat(list[n], suffix);
+		list[++n] = NULL;
+	}
+	return list;
+}
+
+void editorSyntaxFree(struct editorSyntax *syntax) {
+	for (int i = 0; syntax->filematch && syntax->filematch[i]; i++)
+		free(syntax->filematch[i]);
+	for (int i = 0; syntax->keywords && syntax->keywords[i]; i++)
+		free(syntax->keywords[i]);
+	if (syntax->tables) {
+		free(syntax->tables->kw_slots);
+		free(syntax->tables->pool);
+		free(syntax->tables);
+	}
+	free(syntax->filematch);
+	free(syntax->keywords);
+	free(syntax->filetype);
+	free(syntax->singleline_comment_start);
+	free(syntax->multiline_comment_start);
+	free(syntax->multiline_comment_end);
+	free(syntax->quotes);
+	free(syntax->separators);
+	free(syntax);
+}
+
+struct editorSyntax *editorSyntaxParse(const char *path) {
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) return NULL;
+
+	struct editorSyntax *syntax = calloc(1, sizeof(struct editorSyntax));
+	if (syntax == NULL) die("calloc");
+	syntax->flags = HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS;
+
+	char line[1024];
+	while (fgets(line, sizeof(line), fp)) {
+		char *eq = strchr(line, '=');
+		if (line[0] == '#' || eq == NULL) continue;
+		*eq = '\0';
+		char *key = syntaxTrim(line);
+		char *value = syntaxTrim(eq + 1);
+
+		if (strcmp(key, "filetype") == 0) {
+			free(syntax->filetype);
+			syntax->filetype = strdup(value);
+		} else if (strcmp(key, "match") == 0) {
+			syntax->filematch = syntaxAppendWords(syntax->filematch, value, "");
+		} else if (strcmp(key, "keywords") == 0) {
+			syntax->keywords = syntaxAppendWords(syntax->keywords, value, "");
+		} else if (strcmp(key, "keywords2") == 0) {
+			syntax->keywords = syntaxAppendWords(syntax->keywords, value, "|");
+		} else if (strcmp(key, "comment") == 0) {
+			free(syntax->singleline_comment_start);
+			syntax->singleline_comment_start = strdup(value);
+		} else if (strcmp(key, "multiline_comment") == 0) {
+			char *start = strtok(value, " \t");
+			char *end = strtok(NULL, " \t");
+			if (start && end) {
+				syntax->multiline_comment_start = strdup(start);
+				syntax->multiline_comment_end = strdup(end);
+			}
+		} else if (strcmp(key, "strings") == 0) {
+			char quotes[256];
+			int n = 0;
+			for (char *q = value; *q && n < 255; q++)
+				if (!isspace((unsigned char)*q)) quotes[n++] = *q;
+			quotes[n] = '\0';
+			syntax->quotes = strdup(quotes);
+			if (n == 0) syntax->flags &= ~HL_HIGHLIGHT_STRINGS;
+		} else if (strcmp(key, "numbers") == 0) {
+			if (atoi(value)) syntax->flags |= HL_HIGHLIGHT_NUMBERS;
+			else syntax->flags &= ~HL_HIGHLIGHT_NUMBERS;
+		} else if (strcmp(key, "separators") == 0) {
+			free(syntax->separators);
+			syntax->separators = strdup(value);
+		}
+	}
+	fclose(fp);
+
+	if (syntax->filetype == NULL || syntax->filematch == NULL) {
+		editorSyntaxFree(syntax);
+		return NULL;
+	}
+	return syntax;
+}
+
+void editorSyntaxRegister(struct editorSyntax *syntax) {
+	E.syntaxes = realloc(E.syntaxes, sizeof(*E.syntaxes) * (E.nsyntaxes + 1));
+	E.syntaxes[E.nsyntaxes++] = syntax;
+}
+
+int syntaxFileCmp(const void *a, const void *b) {
+	return strcmp(((const struct syntaxFile *)a)->name,
+				  ((const struct syntaxFile *)b)->name);
+}
+
+// List the definition files of dir, sorted by name
+int syntaxListFiles(const char *dir, struct syntaxFile **files) {
+	DIR *d = opendir(dir);
+	if (d == NULL) return -1;
+
+	int n = 0;
+	size_t suffix_len = strlen(SYNTAX_FILE_SUFFIX);
+	struct dirent *ent;
+	*files = NULL;
+	while ((ent = readdir(d)) != NULL) {
+		size_t len = strlen(ent->d_name);
+		if (len <= suffix_len ||
+			strcmp(ent->d_name + len - suffix_len, SYNTAX_FILE_SUFFIX) != 0)
+			continue;
+
+		char path[PATH_MAX];
+		struct stat st;
+		snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+		if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) continue;
+
+		*files = realloc(*files, sizeof(struct syntaxFile) * (n + 1));
+		(*files)[n].name = strdup(ent->d_name);
+		(*files)[n].size = st.st_size;
+		(*files)[n].mtime_sec = st.st_mtim.tv_sec;
+		(*files)[n].mtime_nsec = st.st_mtim.tv_nsec;
+		n++;
+	}
+	closedir(d);
+
+	qsort(*files, n, sizeof(struct syntaxFile), syntaxFileCmp);
+	return n;
+}
+
+void cacheWriteString(FILE *fp, const char *s) {
+	int len = s ? (int)strlen(s) : -1;
+	fwrite(&len, sizeof(len), 1, fp);
+	if (len > 0) fwrite(s, 1, len, fp);
+}
+
+char *cacheReadString(FILE *fp) {
+	int len;
+	if (fread(&len, sizeof(len), 1, fp) != 1 || len < 0 || len > (1 << 20))
+		return NULL;
+	char *s = malloc(len + 1);
+	if (fread(s, 1, len, fp) != (size_t)len) {
+		free(s);
+		return NULL;
+	}
+	s[len] = '\0';
+	return s;
+}
+
+// Header of the cache, used to spot files written by another build
+struct syntaxCacheHeader {
+	char magic[8];
+	int tables_size;
+	int keyword_size;
+	int nfiles;
+	int nsyntaxes;
+};
+
+void editorSyntaxCacheWrite(const char *dir, struct syntaxFile *files,
+							int nfiles, int first) {
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	snprintf(path, sizeof(path), "%s/%s", dir, SYNTAX_CACHE_FILENAME);
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+	FILE *fp = fopen(tmp, "wb");
+	if (fp == NULL) return;
+
+	struct syntaxCacheHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SYNTAX_CACHE_MAGIC, sizeof(h.magic));
+	h.tables_size = offsetof(struct syntaxTables, kw_slots);
+	h.keyword_size = sizeof(struct keyword);
+	h.nfiles = nfiles;
+	h.nsyntaxes = E.nsyntaxes - first;
+	fwrite(&h, sizeof(h), 1, fp);
+
+	for (int i = 0; i < nfiles; i++) {
+		cacheWriteString(fp, files[i].name);
+		fwrite(&files[i].size, sizeof(long long), 3, fp);
+	}
+
+	for (int i = first; i < E.nsyntaxes; i++) {
+		struct editorSyntax *s = E.syntaxes[i];
+		struct syntaxTables *t = s->tables;
+		int nmatch = 0;
+		while (s->filematch[nmatch]) nmatch++;
+
+		cacheWriteString(fp, s->filetype);
+		fwrite(&nmatch, sizeof(nmatch), 1, fp);
+		for (int j = 0; j < nmatch; j++) cacheWriteString(fp, s->filematch[j]);
+		fwrite(t, h.tables_size, 1, fp);
+		fwrite(t->kw_slots, sizeof(struct keyword), t->kw_mask + 1, fp);
+		fwrite(t->pool, 1, t->pool_len, fp);
+	}
+
+	if (fclose(fp) != 0 || rename(tmp, path) == -1) unlink(tmp);
+}
+
+// Register the syntaxes stored in the cache if it was built from exactly
+// these files. Returns 0 on success.
+int editorSyntaxCacheRead(const char *dir, struct syntaxFile *files,
+						  int nfiles) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, SYNTAX_CACHE_FILENAME);
+
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) return -1;
+
+	struct syntaxCacheHeader h;
+	if (fread(&h, sizeof(h), 1, fp) != 1 ||
+		memcmp(h.magic, SYNTAX_CACHE_MAGIC, sizeof(h.magic)) != 0 ||
+		h.tables_size != (int)offsetof(struct syntaxTables, kw_slots) ||
+		h.keyword_size != (int)sizeof(struct keyword) || h.nfiles != nfiles)
+		goto stale;
+
+	for (int i = 0; i < nfiles; i++) {
+		long long stamp[3];
+		char *name = cacheReadString(fp);
+		int same = name && strcmp(name, files[i].name) == 0 &&
+				   fread(stamp, sizeof(long long), 3, fp) == 3 &&
+				   stamp[0] == files[i].size &&
+				   stamp[1] == files[i].mtime_sec &&
+				   stamp[2] == files[i].mtime_nsec;
+		free(name);
+		if (!same) goto stale;
+	}
+
+	int first = E.nsyntaxes;
+	for (int i = 0; i < h.nsyntaxes; i++) {
+		struct editorSyntax *s = calloc(1, sizeof(struct editorSyntax));
+		struct syntaxTables *t = calloc(1, sizeof(struct syntaxTables));
+		if (s == NULL || t == NULL) die("calloc");
+		s->tables = t;
+
+		int nmatch;
+		s->filetype = cacheReadString(fp);
+		if (s->filetype == NULL || fread(&nmatch, sizeof(nmatch), 1, fp) != 1 ||
+			nmatch < 1 || nmatch > 1024)
+			goto corrupt;
+		s->filematch = calloc(nmatch + 1, sizeof(char *));
+		for (int j = 0; j < nmatch; j++)
+			if ((s->filematch[j] = cacheReadString(fp)) == NULL) goto corrupt;
+
+		if (fread(t, h.tables_size, 1, fp) != 1 || t->kw_mask > (1u << 24) ||
+			t->pool_len < 0 || t->pool_len > (1 << 24))
+			goto corrupt;
+		t->kw_slots = malloc(sizeof(struct keyword) * (t->kw_mask + 1));
+		t->pool = malloc(t->pool_len + 1);
+		if (fread(t->kw_slots, sizeof(struct keyword), t->kw_mask + 1, fp) !=
+				t->kw_mask + 1 ||
+			fread(t->pool, 1, t->pool_len, fp) != (size_t)t->pool_len)
+			goto corrupt;
+
+		editorSyntaxRegister(s);
+		continue;
+
+	corrupt:
+		// Parse the files again, whatever was read so far is dropped
+		editorSyntaxFree(s);
+		while (E.nsyntaxes > first) editorSyntaxFree(E.syntaxes[--E.nsyntaxes]);
+		goto stale;
+	}
+
+	fclose(fp);
+	return 0;
+
+stale:
+	fclose(fp);
+	return -1;
+}
+
+// Load the language definitions of dir, from the cache when it is up to
+// date and by parsing and compiling the files otherwise
+void editorLoadSyntaxes(const char *dir) {
+	struct syntaxFile *files;
+	int nfiles = syntaxListFiles(dir, &files);
+	if (nfiles <= 0) return;
+
+	if (editorSyntaxCacheRead(dir, files, nfiles) == -1) {
+		int first = E.nsyntaxes;
+		for (int i = 0; i < nfiles; i++) {
+			char path[PATH_MAX];
+			snprintf(path, sizeof(path), "%s/%s", dir, files[i].name);
+			struct editorSyntax *s = editorSyntaxParse(path);
+			if (s == NULL) continue;
+			editorSyntaxCompile(s);
+			editorSyntaxRegister(s);
+		}
+		if (!E.bench.active) editorSyntaxCacheWrite(dir, files, nfiles, first);
+	}
+
+	for (int i = 0; i < nfiles; i++) free(files[i].name);
+	free(files);
+}
+
+/* utf-8 */
+
+// Display width of codepoints that do not take one column, sorted
+struct charWidth {
+	int lo, hi;
+	int width;
+};
+
+static const struct charWidth char_widths[] = {
+	{ 0x0300, 0x036F, 0 }, { 0x0483, 0x0489, 0 }, { 0x0591, 0x05BD, 0 },
+	{ 0x05BF, 0x05C7, 0 }, { 0x0610, 0x061A, 0 }, { 0x064B, 0x065F, 0 },
+	{ 0x0670, 0x0670, 0 }, { 0x06D6, 0x06DC, 0 }, { 0x06DF, 0x06E4, 0 },
+	{ 0x0900, 0x0902, 0 }, { 0x093C, 0x093C, 0 }, { 0x0941, 0x0948, 0 },
+	{ 0x094D, 0x094D, 0 }, { 0x0E31, 0x0E31, 0 }, { 0x0E34, 0x0E3A, 0 },
+	{ 0x0E47, 0x0E4E, 0 }, { 0x1100, 0x115F, 2 }, { 0x1AB0, 0x1AFF, 0 },
+	{ 0x1DC0, 0x1DFF, 0 }, { 0x200B, 0x200F, 0 }, { 0x202A, 0x202E, 0 },
+	{ 0x2060, 0x2064, 0 }, { 0x20D0, 0x20FF, 0 }, { 0x231A, 0x231B, 2 },
+	{ 0x2329, 0x232A, 2 }, { 0x23E9, 0x23EC, 2 }, { 0x23F0, 0x23F0, 2 },
+	{ 0x23F3, 0x23F3, 2 }, { 0x25FD, 0x25FE, 2 }, { 0x2614, 0x2615, 2 },
+	{ 0x2648, 0x2653, 2 }, { 0x267F, 0x267F, 2 }, { 0x2693, 0x2693, 2 },
+	{ 0x26A1, 0x26A1, 2 }, { 0x26AA, 0x26AB, 2 }, { 0x26BD, 0x26BE, 2 },
+	{ 0x26C4, 0x26C5, 2 }, { 0x26CE, 0x26CE, 2 }, { 0x26D4, 0x26D4, 2 },
+	{ 0x26EA, 0x26EA, 2 }, { 0x26F2, 0x26F5, 2 }, { 0x26FA, 0x26FD, 2 },
+	{ 0x2705, 0x2705, 2 }, { 0x270A, 0x270B, 2 }, { 0x2728, 0x2728, 2 },
+	{ 0x274C, 0x274E, 2 }, { 0x2753, 0x2757, 2 }, { 0x2795, 0x2797, 2 },
+	{ 0x27B0, 0x27B0, 2 }, { 0x27BF, 0x27BF, 2 }, { 0x2B1B, 0x2B1C, 2 },
+	{ 0x2B50, 0x2B50, 2 }, { 0x2B55, 0x2B55, 2 }, { 0x2E80, 0x303E, 2 },
+	{ 0x3041, 0x33FF, 2 }, { 0x3400, 0x4DBF, 2 }, { 0x4E00, 0x9FFF, 2 },
+	{ 0xA000, 0xA4CF, 2 }, { 0xA960, 0xA97F, 2 }, { 0xAC00, 0xD7A3, 2 },
+	{ 0xF900, 0xFAFF, 2 }, { 0xFE00, 0xFE0F, 0 }, { 0xFE10, 0xFE19, 2 },
+	{ 0xFE20, 0xFE2F, 0 }, { 0xFE30, 0xFE6F, 2 }, { 0xFEFF, 0xFEFF, 0 },
+	{ 0xFF00, 0xFF60, 2 }, { 0xFFE0, 0xFFE6, 2 }, { 0x16FE0, 0x16FE4, 2 },
+	{ 0x17000, 0x18CFF, 2 }, { 0x1B000, 0x1B2FF, 2 }, { 0x1F004, 0x1F004, 2 },
+	{ 0x1F0CF, 0x1F0CF, 2 }, { 0x1F18E, 0x1F18E, 2 }, { 0x1F191, 0x1F19A, 2 },
+	{ 0x1F200, 0x1F251, 2 }, { 0x1F300, 0x1F64F, 2 }, { 0x1F680, 0x1F6FF, 2 },
+	{ 0x1F7E0, 0x1F7EB, 2 }, { 0x1F900, 0x1F9FF, 2 }, { 0x1FA70, 0x1FAFF, 2 },
+	{ 0x20000, 0x2FFFD, 2 }, { 0x30000, 0x3FFFD, 2 }, { 0xE0100, 0xE01EF, 0 }
+};
+
+#define CHAR_WIDTHS (sizeof(char_widths) / sizeof(char_widths[0]))
+
+int utf8Width(int cp) {
+	if (cp < char_widths[0].lo) return 1;
+	int lo = 0, hi = CHAR_WIDTHS;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (char_widths[mid].hi < cp) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo < (int)CHAR_WIDTHS && char_widths[lo].lo <= cp) return char_widths[lo].width;
+	return 1;
+}
+
+// Decode the character at the start of s. Returns its length in bytes,
+// *cp is -1 for a byte that does not start a valid sequence.
+int utf8Decode(const char *s, int len, int *cp) {
+	const unsigned char *u = (const unsigned char *)s;
+	*cp = -1;
+	if (u[0] < 0x80) {
+		*cp = u[0];
+		return 1;
+	}
+
+	int n, c, min;
+	if ((u[0] & 0xe0) == 0xc0) { n = 2; c = u[0] & 0x1f; min = 0x80; }
+	else if ((u[0] & 0xf0) == 0xe0) { n = 3; c = u[0] & 0x0f; min = 0x800; }
+	else if ((u[0] & 0xf8) == 0xf0) { n = 4; c = u[0] & 0x07; min = 0x10000; }
+	else return 1;
+	if (n > len) return 1;
+
+	for (int i = 1; i < n; i++) {
+		if ((u[i] & 0xc0) != 0x80) return 1;
+		c = (c << 6) | (u[i] & 0x3f);
+	}
+	// Overlong forms, surrogates and what is past Unicode are not valid
+	if (c < min || (c >= 0xd800 && c <= 0xdfff) || c > 0x10ffff) return 1;
+	*cp = c;
+	return n;
+}
+
+// Start of the character that ends right before at
+int utf8Prev(const char *s, int at) {
+	int start = at - 1;
+	while (start > 0 && at - start < 4 && (s[start] & 0xc0) == 0x80) start--;
+
+	int cp;
+	if (utf8Decode(&s[start], at - start, &cp) == at - start) return start;
+	return at - 1;
+}
+
+/* row operations */
+
+// Map pos, counted in the from coordinate of the row, to the to
+// coordinate. A position inside a character maps to where it starts.
+int editorRowMapPos(erow *row, int pos, int from, int to) {
+	// Last mark at or before pos, everything between marks is one byte
+	// and one column per character
+	int lo = 0, hi = row->cmap_len;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (row->cmap[mid].at[from] <= pos) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo == 0) return pos;
+
+	struct colMark *m = &row->cmap[lo - 1];
+	int off = pos - m->at[from];
+	if (off < m->len[from]) return m->at[to];
+	return m->at[to] + m->len[to] + off - m->len[from];
+}
+
+int editorRowCxToRx(erow *row, int cx) {
+	editorRowLayout(row);
+	return editorRowMapPos(row, cx, POS_CHARS, POS_SCREEN);
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+	editorRowLayout(row);
+	int cx = editorRowMapPos(row, rx, POS_SCREEN, POS_CHARS);
+	return cx < row->size ? cx : row->size;
+}
+
+// Start of the character cx points into
+int editorRowSnap(erow *row, int cx) {
+	editorRowLayout(row);
+	return editorRowMapPos(row, cx, POS_CHARS, POS_CHARS);
+}
+
+// Keep E.cx within the row at E.cy, at the start of a character
+void editorSnapCursor(void) {
+	erow *row = editorRowAt(E.cy);
+	int rowlen = row ? row->size : 0;
+	if (E.cx > rowlen) E.cx = rowlen;
+	if (row) E.cx = editorRowSnap(row, E.cx);
+}
+
+// Where the cursor goes from cx one character to the right or left.
+// Marks that draw over a character move with it.
+int editorRowStep(erow *row, int cx, int dir) {
+	int cp;
+	if (dir > 0) cx += utf8Decode(&row->chars[cx], row->size - cx, &cp);
+	else cx = utf8Prev(row->chars, cx);
+
+	while (cx > 0 && cx < row->size) {
+		int n = utf8Decode(&row->chars[cx], row->size - cx, &cp);
+		if (cp == -1 || utf8Width(cp) != 0) break;
+		cx = dir > 0 ? cx + n : utf8Prev(row->chars, cx);
+	}
+	return cx;
+}
+
+// Chars index of a render offset, for search matches
+int editorRowRenderToCx(erow *row, int r) {
+	editorRowLayout(row);
+	int cx = editorRowMapPos(row, r, POS_RENDER, POS_CHARS);
+	return cx < row->size ? cx : row->size;
+}
+
+// Room editorRenderChars needs for the row's render, in tabs how many
+// tabs it expands and in marks how many column marks it can make at most
+int editorRenderSize(erow *row, int *ntabs, int *marks) {
+	int tabs = 0, high = 0;
+	int j;
+	for (j = 0; j < row->size; j++) {
+		if (row->chars[j] == '\t') tabs++;
+		else if (row->chars[j] & 0x80) high++;
+	}
+	if (ntabs) *ntabs = tabs;
+	if (marks) *marks = tabs + high;
+	return row->size + tabs*(cfg.tab_stop - 1) + 1;
+}
+
+// Expand tabs of the row's chars into dst to the next tab stop on the
+// screen. Returns the rendered length. Marks for tabs and characters
+// that are not one byte wide go to map unless it is NULL, their number
+// to marks. With dst NULL only the marks are made, for rows without tabs
+// whose render is their chars.
+int editorRenderChars(erow *row, char *dst, struct colMark *map, int *marks) {
+	int idx = 0, col = 0, n = 0;
+	int j = 0;
+	while (j < row->size) {
+		unsigned char c = row->chars[j];
+		if (c < 0x80 && c != '\t') {
+			if (dst) dst[idx] = c;
+			idx++;
+			col++;
+			j++;
+			continue;
+		}
+
+		int len = 1, rlen, width;
+		if (c == '\t') {
+			width = rlen = cfg.tab_stop - col % cfg.tab_stop;
+			if (dst) memset(&dst[idx], ' ', rlen);
+		} else {
+			int cp;
+			len = rlen = utf8Decode(&row->chars[j], row->size - j, &cp);
+			width = cp == -1 ? 1 : utf8Width(cp);
+			if (dst) memcpy(&dst[idx], &row->chars[j], len);
+		}
+		if (map) {
+			map[n] = (struct colMark){ { j, idx, col }, { len, rlen, width } };
+			n++;
+		}
+		j += len;
+		idx += rlen;
+		col += width;
+	}
+	if (dst) dst[idx] = '\0';  // null terminator
+	if (marks) *marks = n;
+	return idx;
+}
+
+// Rows from at on show up on different screen lines than before
+void editorDamageFrom(int at) {
+	if (at < E.damage_from) E.damage_from = at;
+}
+
+// Called whenever a row's chars change. Nothing is rebuilt here, render
+// and hl are materialized by editorRowRender once the row is looked at.
+void editorUpdateRow(erow *row) {
+	row->stale = 1;
+	row->damaged = 1;
+	row->hl_in = -1;
+	editorSyntaxMark(editorRowIndex(row));
+}
+
+void editorRowFreeRender(erow *row) {
+	if (row->rcap) free(row->render);
+	row->render = NULL;
+	row->rcap = 0;
+	free(row->cmap);
+	row->cmap = NULL;
+	row->cmap_len = 0;
+}
+
+// Bring render and the column map of the row up to date. Rows without
+// tabs render as their chars and share them, only rows with tabs get a
+// buffer of their own, which is kept across edits and only grows. Rows
+// that are plain ASCII on top get no map, every byte is one column there.
+void editorRowLayout(erow *row) {
+	if (row->render != NULL && !row->stale) return;
+
+	// Only tabs render differently from chars, even when a tab_stop of
+	// 1 leaves the size as it is
+	int tabs, marks;
+	int need = editorRenderSize(row, &tabs, &marks);
+	char *dst = NULL;
+	if (tabs) {
+		if (need > row->rcap) {
+			if (row->rcap == 0) row->render = NULL;
+			row->rcap = need + need / 4;
+			row->render = realloc(row->render, row->rcap);
+		}
+		dst = row->render;
+	} else {
+		if (row->rcap) free(row->render);
+		row->rcap = 0;
+		row->render = row->chars;
+	}
+
+	if (marks) {
+		row->cmap = realloc(row->cmap, sizeof(struct colMark) * marks);
+	} else {
+		free(row->cmap);
+		row->cmap = NULL;
+	}
+	if (dst || marks) {
+		row->rsize = editorRenderChars(row, dst, row->cmap, &row->cmap_len);
+	} else {
+		row->rsize = row->size;
+		row->cmap_len = 0;
+	}
+	row->stale = 0;
+	row->hl_in = -1;
+}
+
+// Bring render and hl of the row at index at up to date. Rows past the
+// syntax frontier are lexed from the state the row above has now and
+// fixed up once the frontier reaches them.
+erow *editorRowRender(erow *row, int at) {
+	erow *prev = editorRowPrev(row);
+	int state = prev ? prev->hl_state : 0;
+
+	editorRowLayout(row);
+	if (row->hl_in != state) editorSyntaxLex(row, at, state);
+	return row;
+}
+
+// Insert a row whose chars are already set up by the caller
+erow *editorInsertRowChars(int at, char *chars, size_t len, int mapped) {
+	erow *row = rowTreeInsert(at);
+	E.numrows++;
+
+	row->size = len;
+	row->chars = chars;
+	row->mapped = mapped;
+	rowTreeAddBytes(row, len + 1);
+	row->epoch = E.epoch;
+
+	row->rsize = 0;
+	row->rcap = 0;
+	row->render = NULL;
+	row->cmap = NULL;
+	row->cmap_len = 0;
+	row->hl = NULL;
+	row->hl_nspans = 0;
+	row->hl_state = 0;
+	row->stale = 1;
+	row->damaged = 1;
+	row->hl_in = -1;
+	editorSyntaxShift(at - 1, 1);
+	editorDamageFrom(at);
+	undoRecordRow(UNDO_INSERT_ROWS, at, chars, len);
+	journalRecordRow(UNDO_INSERT_ROWS, at, chars, len);
+	// Rows after a row that was never lexed are already covered
+	erow *prev = editorRowPrev(row);
+	if (prev == NULL || prev->hl_in != -1) editorSyntaxMark(at);
+
+	E.dirty++;
+	return row;
 }
 
 void editorInsertRow(int at, char *s, size_t len) {
 	if (at < 0 || at > E.numrows) return;
-	
-	E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-	memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-	for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
 
-	E.row[at].idx = at;
+	char *chars = malloc(len + 1);
+	memcpy(chars, s, len);
+	chars[len] = '\0';
+	editorInsertRowChars(at, chars, len, 0);
+}
+
+// Whether a running save still writes the row's chars
+int editorRowShared(erow *row) {
+	return E.save.active && row->epoch <= E.save.epoch;
+}
+
+// Give the row chars of its own before they are modified, if they are
+// mapped or a running save writes them
+void editorRowOwn(erow *row) {
+	int shared = editorRowShared(row);
+	if (!row->mapped && !shared) return;
+
+	if (shared) rowNodeTouch(row->leaf);
+	char *chars = malloc(row->size + 1);
+	memcpy(chars, row->chars, row->size);
+	chars[row->size] = '\0';
+	if (shared && !row->mapped) editorSaveRetire(row->chars);
+	row->chars = chars;
+	row->mapped = 0;
+	row->epoch = E.epoch;
+}
+
+void editorFreeRow(erow *row) {
+	editorRowFreeRender(row);
+	if (editorRowShared(row) && !row->mapped) editorSaveRetire(row->chars);
+	else if (!row->mapped) free(row->chars);
+	free(row->hl);
+}
+
+void editorDelRow(int at) {
+	if (at < 0 || at >= E.numrows) return;
+	erow *row = editorRowAt(at);
+	undoRecordRow(UNDO_DELETE_ROWS, at, row->chars, row->size);
+	journalRecordRow(UNDO_DELETE_ROWS, at, NULL, 0);
+	rowTreeAddBytes(row, -(row->size + 1));
+	editorFreeRow(row);
+	rowTreeRemove(at);
+	E.numrows--;
+	editorSyntaxShift(at, -1);
+	editorDamageFrom(at);
+	editorSyntaxMark(at);
+	E.dirty++;
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+	if (at < 0 || at > row->size) at = row->size;
+
+	char ch = c;
+	undoRecordText(UNDO_INSERT_TEXT, row, at, &ch, 1);
+	journalRecordText(UNDO_INSERT_TEXT, row, at, &ch, 1);
+	editorRowOwn(row);
+	row->chars = realloc(row->chars, row->size + 2);
+	memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+	row->size++;
+	rowTreeAddBytes(row, 1);
+	row->chars[at] = c;
+	editorUpdateRow(row);
+	E.dirty++;
+}
+
+void editorRowInsertString(erow *row, int at, const char *s, size_t len) {
+	if (at < 0 || at > row->size) at = row->size;
+
+	undoRecordText(UNDO_INSERT_TEXT, row, at, s, len);
+	journalRecordText(UNDO_INSERT_TEXT, row, at, s, len);
+	editorRowOwn(row);
+	row->chars = realloc(row->chars, row->size + len + 1);
+	memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+	memcpy(&row->chars[at], s, len);
+	row->size += len;
+	rowTreeAddBytes(row, len);
+	editorUpdateRow(row);
+	E.dirty++;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+	undoRecordText(UNDO_INSERT_TEXT, row, row->size, s, len);
+	journalRecordText(UNDO_INSERT_TEXT, row, row->size, s, len);
+	editorRowOwn(row);
+	row->chars = realloc(row->chars, row->size + len + 1);
+	memcpy(&row->chars[row->size], s, len);
+	row->size += len;
+	rowTreeAddBytes(row, len);
+	row->chars[row->size] = '\0';
+	editorUpdateRow(row);
+	E.dirty++;
+}
+
+void editorRowDelString(erow *row, int at, size_t len) {
+	if (at < 0 || at > row->size) return;
+	if (len > (size_t)(row->size - at)) len = row->size - at;
+	if (len == 0) return;
+
+	undoRecordText(UNDO_DELETE_TEXT, row, at, &row->chars[at], len);
+	journalRecordText(UNDO_DELETE_TEXT, row, at, NULL, len);
+	editorRowOwn(row);
+	memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+	row->size -= len;
+	rowTreeAddBytes(row, -(long long)len);
+	editorUpdateRow(row);
+	E.dirty++;
+}
+
+/* editor operations */
+
+void editorInsertChar(int c) {
+	if (E.cy == E.numrows) {
+		editorInsertRow(E.numrows, "", 0);
+	}
+	editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+	E.cx++;
+}
+
+void editorInsertNewline(void) {
+	if (E.cx == 0) {
+		editorInsertRow(E.cy, "", 0);
+	} else {
+		erow *row = editorRowAt(E.cy);
+		editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+		row = editorRowAt(E.cy);  // the insert may have moved it
+		editorRowDelString(row, E.cx, row->size - E.cx);
+	}
+	// Move the cursor one line below and auto indent
+	int temp = 0;
+	erow *row = editorRowAt(E.cy);
+	for (int i = 0; i < row->size; i++) {
+		if (row->chars[i] == '\t') {
+			temp++;
+		} else {
+			break;
+		}
+	}
+
+	E.cy++;
+	E.cx = cfg.tab_stop * temp;
+}
+
+// Length of the line at the start of s, a line ends at \r, \n or \r\n
+static int lineLength(const char *s, int len, int *next) {
+	int i = 0;
+	while (i < len && s[i] != '\r' && s[i] != '\n') i++;
+	*next = i;
+	if (i < len) (*next)++;
+	if (i < len && s[i] == '\r' && i + 1 < len && s[i + 1] == '\n') (*next)++;
+	return i;
+}
+
+// Insert a block of text at the cursor as is, without auto indent. Rows
+// are split off in one pass and highlighting starts over only once from
+// the first changed row.
+void editorInsertBlock(const char *s, int len) {
+	if (len == 0) return;
+	if (E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
+
+	int next;
+	int linelen = lineLength(s, len, &next);
+	erow *row = editorRowAt(E.cy);
+	if (next == len && linelen == len) {
+		editorRowInsertString(row, E.cx, s, len);
+		E.cx += len;
+		return;
+	}
+
+	// The rest of the cursor row goes to the end of the last pasted line
+	int taillen = row->size - E.cx;
+	char *tail = malloc(taillen);
+	memcpy(tail, &row->chars[E.cx], taillen);
+	editorRowDelString(row, E.cx, taillen);
+	editorRowAppendString(row, (char *)s, linelen);
+
+	int at = E.cy;
+	while (1) {
+		s += next;
+		len -= next;
+		linelen = lineLength(s, len, &next);
+		at++;
+		if (next == linelen) {
+			// Last line, possibly empty when the paste ends with a newline
+			char *chars = malloc(linelen + taillen + 1);
+			memcpy(chars, s, linelen);
+			memcpy(&chars[linelen], tail, taillen);
+			chars[linelen + taillen] = '\0';
+			editorInsertRowChars(at, chars, linelen + taillen, 0);
+			break;
+		}
+		editorInsertRow(at, (char *)s, linelen);
+	}
+	free(tail);
+
+	E.cy = at;
+	E.cx = linelen;
+}
+
+void editorPaste(void) {
+	int len;
+	char *text = editorReadPaste(&len);
+	editorInsertBlock(text, len);
+	free(text);
+}
+
+void editorDelChar(void) {
+	if (E.cy == E.numrows) return;
+	if (E.cx == 0 && E.cy == 0) return;
+
+	erow *row = editorRowAt(E.cy);
+	if (E.cx > 0) {
+		int start = editorRowStep(row, E.cx, -1);
+		editorRowDelString(row, start, E.cx - start);
+		E.cx = start;
+	} else {
+		erow *prev = editorRowPrev(row);
+		E.cx = prev->size;
+		editorRowAppendString(prev, row->chars, row->size);
+		editorDelRow(E.cy);
+		E.cy--;
+	}
+}
+
+/* undo
+ *
+ * Edits are recorded at the row operations, as the text or rows they
+ * inserted or deleted, into one arena: every record is a struct
+ * undoRecord, its data and its total size, so the log can be walked both
+ * ways. Inserted and deleted rows carry their lines, each prefixed with
+ * its length. Records are grouped under an UNDO_GROUP record holding the
+ * cursor, one group per key. Typed characters and deletions next to the
+ * last ones grow the last record instead of adding one, and so do rows
+ * inserted right after the last inserted ones, which makes a big paste a
+ * single record. Undo walks back over a group applying the inverse of
+ * every record, redo walks forward again. Once the log holds more than
+ * cfg.undo_memory, the oldest groups are dropped. */
+
+#define UNDO_RECORD_SIZE(len) (sizeof(struct undoRecord) + (len) + sizeof(size_t))
+
+void undoReserve(size_t n) {
+	struct undoLog *u = &E.undo;
+	if (u->end + n <= u->cap) return;
+
+	// Reuse the room of dropped groups once it is as big as what is kept
+	if (u->start >= u->end - u->start) {
+		memmove(u->buf, u->buf + u->start, u->end - u->start);
+		u->end -= u->start;
+		u->undo_end -= u->start;
+		u->group -= u->start;
+		u->start = 0;
+	}
+	while (u->end + n > u->cap) u->cap = u->cap ? u->cap * 2 : 4096;
+	u->buf = realloc(u->buf, u->cap);
+}
+
+struct undoRecord undoGet(size_t pos) {
+	struct undoRecord r;
+	memcpy(&r, E.undo.buf + pos, sizeof(r));
+	return r;
+}
+
+void undoPut(size_t pos, const struct undoRecord *r) {
+	memcpy(E.undo.buf + pos, r, sizeof(*r));
+}
+
+// Where the record ending at pos starts
+size_t undoPrev(size_t pos) {
+	size_t size;
+	memcpy(&size, E.undo.buf + pos - sizeof(size), sizeof(size));
+	return pos - size;
+}
+
+size_t undoNext(size_t pos) {
+	return pos + UNDO_RECORD_SIZE(undoGet(pos).len);
+}
+
+// Turn the data of the text record at pos around
+void undoFlip(size_t pos) {
+	struct undoRecord r = undoGet(pos);
+	char *data = E.undo.buf + pos + sizeof(r);
+	for (int i = 0, j = r.len - 1; i < j; i++, j--) {
+		char c = data[i];
+		data[i] = data[j];
+		data[j] = c;
+	}
+	r.count = !r.count;
+	undoPut(pos, &r);
+}
+
+// Backspacing grows the last record at its start. Its data is kept
+// backwards until nothing can extend it any more, then turned around once.
+void undoSeal(void) {
+	struct undoLog *u = &E.undo;
+	if (u->end == u->start) return;
+	size_t pos = undoPrev(u->end);
+	struct undoRecord r = undoGet(pos);
+	if (r.type == UNDO_DELETE_TEXT && r.count) undoFlip(pos);
+}
+
+// Append a record whose data is reserved but left to the caller
+char *undoAppend(const struct undoRecord *r) {
+	struct undoLog *u = &E.undo;
+	undoSeal();
+	size_t size = UNDO_RECORD_SIZE(r->len);
+	undoReserve(size);
+	size_t pos = u->end;
+	undoPut(pos, r);
+	memcpy(u->buf + pos + size - sizeof(size), &size, sizeof(size));
+	u->end += size;
+	u->undo_end = u->end;
+	return u->buf + pos + sizeof(*r);
+}
+
+// Grow the last record by len bytes of data at its end. Returns where the
+// new bytes go.
+char *undoExtend(int len) {
+	struct undoLog *u = &E.undo;
+	undoReserve(len);
+
+	size_t pos = undoPrev(u->end);
+	struct undoRecord r = undoGet(pos);
+	char *data = u->buf + pos + sizeof(r);
+	r.len += len;
+	undoPut(pos, &r);
+
+	size_t size = UNDO_RECORD_SIZE(r.len);
+	memcpy(u->buf + pos + size - sizeof(size), &size, sizeof(size));
+	u->end = u->undo_end = pos + size;
+	return data + r.len - len;
+}
+
+// Drop the oldest group
+void undoEvict(void) {
+	struct undoLog *u = &E.undo;
+	size_t pos = undoNext(u->start);
+	while (pos < u->end && undoGet(pos).type != UNDO_GROUP) pos = undoNext(pos);
+	u->start = pos;
+	if (u->undo_end < pos) u->undo_end = pos;
+	if (u->start == u->end) u->start = u->end = u->undo_end = 0;
+}
+
+// Start a new group for the edits of the current key, forgetting what
+// was undone and what does not fit into the history any more
+void undoBeginGroup(void) {
+	struct undoLog *u = &E.undo;
+	u->end = u->undo_end;
+	size_t limit = (size_t)cfg.undo_memory << 20;
+	while (u->end > u->start && u->end - u->start > limit) undoEvict();
+
+	struct undoRecord r = { UNDO_GROUP, 0, 0, 0, sizeof(struct undoCursor) };
+	struct undoCursor cur = { u->cx, u->cy, u->cx, u->cy };
+	memcpy(undoAppend(&r), &cur, sizeof(cur));
+	u->group = u->end - UNDO_RECORD_SIZE(r.len);
+	u->open = 1;
+}
+
+// The last record if it belongs to the open group, otherwise NULL
+int undoLast(struct undoRecord *r) {
+	struct undoLog *u = &E.undo;
+	size_t pos = undoPrev(u->end);
+	if (pos == u->group) return 0;
+	*r = undoGet(pos);
+	return 1;
+}
+
+// Record text going into or out of a row, before the row changes
+void undoRecordText(int type, erow *row, int col, const char *s, int len) {
+	struct undoLog *u = &E.undo;
+	if (u->paused || len == 0) return;
+	if (!u->open) undoBeginGroup();
+
+	int at = editorRowIndex(row);
+	struct undoRecord last;
+	if (undoLast(&last) && last.type == type && last.at == at) {
+		if (type == UNDO_INSERT_TEXT && col == last.col + last.len) {
+			memcpy(undoExtend(len), s, len);
+			return;
+		}
+		if (type == UNDO_DELETE_TEXT && col == last.col) {
+			// Deleting forward
+			undoSeal();
+			memcpy(undoExtend(len), s, len);
+			return;
+		}
+		if (type == UNDO_DELETE_TEXT && col + len == last.col) {
+			// Backspacing: the bytes go on backwards
+			size_t pos = undoPrev(u->end);
+			if (!last.count) undoFlip(pos);
+			char *data = undoExtend(len);
+			for (int i = 0; i < len; i++) data[i] = s[len - 1 - i];
+			pos = undoPrev(u->end);
+			last = undoGet(pos);
+			last.col = col;
+			undoPut(pos, &last);
+			return;
+		}
+	}
+
+	struct undoRecord r = { type, at, col, 0, len };
+	memcpy(undoAppend(&r), s, len);
+}
+
+// Record a row going in or out at index at, with its chars
+void undoRecordRow(int type, int at, const char *s, int len) {
+	struct undoLog *u = &E.undo;
+	if (u->paused) return;
+	if (!u->open) undoBeginGroup();
+
+	struct undoRecord last;
+	int extend = undoLast(&last) && last.type == type &&
+		((type == UNDO_INSERT_ROWS && at == last.at + last.count) ||
+		 (type == UNDO_DELETE_ROWS && at == last.at));
+	char *data;
+	if (extend) {
+		data = undoExtend(sizeof(int) + len);
+		last.count++;
+		last.len += sizeof(int) + len;
+		undoPut(undoPrev(u->end), &last);
+	} else {
+		struct undoRecord r = { type, at, 0, 1, sizeof(int) + len };
+		data = undoAppend(&r);
+	}
+	memcpy(data, &len, sizeof(int));
+	memcpy(data + sizeof(int), s, len);
+}
+
+// Called after every key: the group keeps the cursor it left behind, and
+// only typing and deleting go on in the same group
+void undoEndKey(int typing) {
+	struct undoLog *u = &E.undo;
+	if (!u->open) return;
+
+	struct undoCursor cur;
+	char *data = u->buf + u->group + sizeof(struct undoRecord);
+	memcpy(&cur, data, sizeof(cur));
+	cur.redo_cx = E.cx;
+	cur.redo_cy = E.cy;
+	memcpy(data, &cur, sizeof(cur));
+	if (!typing) u->open = 0;
+}
+
+// Apply a record again or take it back
+void undoApply(struct undoRecord *r, const char *data, int redo) {
+	int insert = (r->type == UNDO_INSERT_TEXT || r->type == UNDO_INSERT_ROWS) == redo;
+
+	if (r->type == UNDO_INSERT_TEXT || r->type == UNDO_DELETE_TEXT) {
+		erow *row = editorRowAt(r->at);
+		if (insert) editorRowInsertString(row, r->col, data, r->len);
+		else editorRowDelString(row, r->col, r->len);
+		return;
+	}
+
+	for (int i = 0; i < r->count; i++) {
+		if (!insert) {
+			editorDelRow(r->at);
+			continue;
+		}
+		int len;
+		memcpy(&len, data, sizeof(int));
+		editorInsertRow(r->at + i, (char *)data + sizeof(int), len);
+		data += sizeof(int) + len;
+	}
+}
+
+void undoSetCursor(int cx, int cy) {
+	E.cy = cy < E.numrows ? cy : E.numrows;
+	E.cx = cx;
+	editorSnapCursor();
+}
+
+void editorUndo(void) {
+	struct undoLog *u = &E.undo;
+	u->open = 0;
+	if (u->undo_end == u->start) {
+		editorSetStatusMessage("Nothing to undo");
+		return;
+	}
+	if (u->undo_end == u->end) undoSeal();
+
+	u->paused = 1;
+	size_t pos = undoPrev(u->undo_end);
+	struct undoRecord r;
+	while ((r = undoGet(pos)).type != UNDO_GROUP) {
+		undoApply(&r, u->buf + pos + sizeof(r), 0);
+		pos = undoPrev(pos);
+	}
+	u->paused = 0;
+
+	struct undoCursor cur;
+	memcpy(&cur, u->buf + pos + sizeof(r), sizeof(cur));
+	undoSetCursor(cur.cx, cur.cy);
+	u->undo_end = pos;
+}
+
+void editorRedo(void) {
+	struct undoLog *u = &E.undo;
+	u->open = 0;
+	if (u->undo_end == u->end) {
+		editorSetStatusMessage("Nothing to redo");
+		return;
+	}
+
+	struct undoCursor cur;
+	memcpy(&cur, u->buf + u->undo_end + sizeof(struct undoRecord), sizeof(cur));
+
+	u->paused = 1;
+	size_t pos = undoNext(u->undo_end);
+	struct undoRecord r;
+	while (pos < u->end && (r = undoGet(pos)).type != UNDO_GROUP) {
+		undoApply(&r, u->buf + pos + sizeof(r), 1);
+		pos = undoNext(pos);
+	}
+	u->paused = 0;
+
+	undoSetCursor(cur.redo_cx, cur.redo_cy);
+	u->undo_end = pos;
+}
+
+/* journal
+ *
+ * Edits are appended to a journal next to the file as they are made, at
+ * the row operations like the undo records. Records collect in a buffer
+ * that is written whenever the editor waits for input, so a crash of the
+ * editor or a hung up terminal loses nothing. One fsync takes all records
+ * written in JOURNAL_SYNC_MS, which is all a crash of the machine can
+ * lose. The journal starts with the size, mtime
+ * and inode of the file the edits apply to. Opening that file again
+ * offers to replay them, and a finished save starts the journal over
+ * from the saved file. Nothing in here depends on the size of the file.
+ */
+
+unsigned int journalSum(const struct journalRecord *r, const char *data) {
+	unsigned int h = 2166136261u;
+	const unsigned char *p = (const unsigned char *)r;
+	for (size_t i = 0; i < offsetof(struct journalRecord, sum); i++)
+		h = (h ^ p[i]) * 16777619u;
+	for (int i = 0; data && i < r->len; i++)
+		h = (h ^ (unsigned char)data[i]) * 16777619u;
+	return h;
+}
+
+// Data a record carries: the text or row that goes in, nothing for what
+// goes out
+int journalDataLen(const struct journalRecord *r) {
+	return r->type == UNDO_INSERT_TEXT || r->type == UNDO_INSERT_ROWS ? r->len : 0;
+}
+
+// .name.journal in the directory of filename
+char *journalPath(const char *filename) {
+	const char *base = strrchr(filename, '/');
+	int dirlen = base ? base - filename + 1 : 0;
+	base = base ? base + 1 : filename;
+
+	int len = dirlen + strlen(base) + 10;
+	char *path = malloc(len);
+	snprintf(path, len, "%.*s.%s.journal", dirlen, filename, base);
+	return path;
+}
+
+int journalStat(const char *filename, struct journalHeader *h) {
+	struct stat st;
+	if (stat(filename, &st) == -1) return -1;
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, JOURNAL_MAGIC, sizeof(h->magic));
+	h->size = st.st_size;
+	h->mtime = (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	h->ino = st.st_ino;
+	return 0;
+}
+
+long long journalNow(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Hand the buffered records to the kernel
+int journalWrite(void) {
+	struct journal *j = &E.journal;
+	if (j->fd == -1 || j->len == 0) return 0;
+
+	struct iovec iov = { j->buf, j->len };
+	if (writeAll(j->fd, &iov, 1) == -1) {
+		editorSetStatusMessage("Journal off, can't write it: %s", strerror(errno));
+		close(j->fd);
+		j->fd = -1;
+		return -1;
+	}
+	j->len = 0;
+	return 0;
+}
+
+// Write the buffered records and wait for them to be on disk
+void journalSync(void) {
+	struct journal *j = &E.journal;
+	if (journalWrite() == 0 && j->fd != -1 && j->due) fdatasync(j->fd);
+	j->due = 0;
+}
+
+void journalRecord(int type, int at, int col, const char *s, int len) {
+	struct journal *j = &E.journal;
+	struct journalRecord r = { type, at, col, len, 0 };
+	int dlen = journalDataLen(&r);
+	r.sum = journalSum(&r, dlen ? s : NULL);
+
+	int need = sizeof(r) + dlen;
+	if (j->len + need > j->cap) {
+		if (journalWrite() == -1) return;
+		if (need > j->cap) {
+			j->cap = need > JOURNAL_BUFFER_SIZE ? need : JOURNAL_BUFFER_SIZE;
+			j->buf = realloc(j->buf, j->cap);
+			if (j->buf == NULL) die("realloc");
+		}
+	}
+	memcpy(j->buf + j->len, &r, sizeof(r));
+	if (dlen) memcpy(j->buf + j->len + sizeof(r), s, dlen);
+	j->len += need;
+	j->size += need;
+	if (j->due == 0) j->due = journalNow() + JOURNAL_SYNC_MS;
+}
+
+void journalRecordText(int type, erow *row, int col, const char *s, int len) {
+	if (E.journal.fd == -1 || len == 0) return;
+	journalRecord(type, editorRowIndex(row), col, s, len);
+}
+
+void journalRecordRow(int type, int at, const char *s, int len) {
+	if (E.journal.fd == -1) return;
+	journalRecord(type, at, 0, s, len);
+}
+
+// Milliseconds until buffered records must be synced, -1 if there are
+// none
+int journalTimeout(void) {
+	if (E.journal.due == 0) return -1;
+	long long left = E.journal.due - journalNow();
+	return left > 0 ? (int)left : 0;
+}
+
+// Called by the event loop before it waits. Buffered records are written
+// and synced once they are due.
+void journalUpdate(void) {
+	if (journalTimeout() == 0) journalSync();
+	else journalWrite();
+}
+
+// Start a journal at path for the file as it is on disk now. Edits that
+// are already made but not saved are not in it. Returns its descriptor.
+int journalCreate(const char *path) {
+	struct journalHeader h;
+	int fd = -1;
+	struct iovec iov = { &h, sizeof(h) };
+	if (journalStat(E.filename, &h) == -1 ||
+		(fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600)) == -1 ||
+		writeAll(fd, &iov, 1) == -1) {
+		editorSetStatusMessage("Journal off, can't create %s: %s", path,
+							   strerror(errno));
+		if (fd != -1) close(fd);
+		return -1;
+	}
+	E.journal.size = sizeof(h);
+	return fd;
+}
+
+// Apply the records of a journal to the file just opened. Returns how
+// many were applied, *end is set to where the good records end.
+int journalReplay(FILE *fp, long long *end) {
+	struct journalRecord r;
+	char *data = NULL;
+	int cap = 0, n = 0;
+	*end = sizeof(struct journalHeader);
+
+	while (fread(&r, sizeof(r), 1, fp) == 1) {
+		int dlen = journalDataLen(&r);
+		if (r.len < 0 || r.at < 0 || r.col < 0) break;
+		if (dlen > cap) {
+			cap = dlen;
+			data = realloc(data, cap);
+			if (data == NULL) die("realloc");
+		}
+		if (dlen && fread(data, dlen, 1, fp) != 1) break;
+		if (journalSum(&r, dlen ? data : NULL) != r.sum) break;
+
+		// Records that do not fit the rows are from a torn write as well
+		erow *row = r.at < E.numrows ? editorRowAt(r.at) : NULL;
+		if (r.type == UNDO_INSERT_TEXT && row && r.col <= row->size) {
+			editorRowInsertString(row, r.col, data, r.len);
+		} else if (r.type == UNDO_DELETE_TEXT && row && r.col + r.len <= row->size) {
+			editorRowDelString(row, r.col, r.len);
+		} else if (r.type == UNDO_INSERT_ROWS && r.at <= E.numrows) {
+			editorInsertRow(r.at, data ? data : "", r.len);
+		} else if (r.type == UNDO_DELETE_ROWS && row) {
+			editorDelRow(r.at);
+		} else {
+			break;
+		}
+		*end += sizeof(r) + dlen;
+		n++;
+	}
+	free(data);
+	return n;
+}
+
+// Called once the file is opened. A journal left behind for this very
+// file is offered for replay, one for another version of it is moved
+// out of the way.
+// Move a journal that is not replayed to .old, where its edits are not
+// lost, and start a new one
+void journalSetAside(char *old, size_t size) {
+	struct journal *j = &E.journal;
+	snprintf(old, size, "%s.old", j->path);
+	rename(j->path, old);
+	j->fd = journalCreate(j->path);
+}
+
+void journalOpen(void) {
+	struct journal *j = &E.journal;
+	if (!cfg.journal || E.filename == NULL) return;
+	j->path = journalPath(E.filename);
+
+	struct journalHeader want, h;
+	FILE *fp = fopen(j->path, "r");
+	if (fp == NULL) {
+		j->fd = journalCreate(j->path);
+		return;
+	}
+
+	int same = journalStat(E.filename, &want) == 0 &&
+		fread(&h, sizeof(h), 1, fp) == 1 && memcmp(&h, &want, sizeof(h)) == 0;
+	char old[PATH_MAX + 8];
+	if (!same) {
+		fclose(fp);
+		journalSetAside(old, sizeof(old));
+		editorSetStatusMessage("Journal is for another version of the file, "
+							   "moved to %s", old);
+		return;
+	}
+
+	char *answer = editorPrompt("Unsaved edits of this file were found, "
+								"recover them? (y/n) %s", NULL);
+	int recover = answer && (answer[0] == 'y' || answer[0] == 'Y');
+	free(answer);
+	if (!recover) {
+		fclose(fp);
+		journalSetAside(old, sizeof(old));
+		editorSetStatusMessage("Unsaved edits not recovered, kept in %s", old);
+		return;
+	}
+
+	long long end;
+	E.undo.paused = 1;
+	int n = journalReplay(fp, &end);
+	E.undo.paused = 0;
+	fclose(fp);
+
+	// Later records go after the good ones, a torn tail is cut off
+	j->fd = open(j->path, O_RDWR | O_APPEND);
+	if (j->fd == -1 || ftruncate(j->fd, end) == -1) {
+		if (j->fd != -1) close(j->fd);
+		j->fd = -1;
+		editorSetStatusMessage("Journal off, can't reopen %s: %s", j->path,
+							   strerror(errno));
+		return;
+	}
+	j->size = end;
+	editorSetStatusMessage("Recovered %d edits, save to keep them", n);
+}
+
+// A save wrote the rows as they were when it started. The journal starts
+// over from the saved file, keeping the edits made while it was written,
+// and replaces the old one in one rename.
+void journalSaved(void) {
+	struct journal *j = &E.journal;
+	if (!cfg.journal) return;
+
+	char *path = journalPath(E.filename);
+	if (j->fd == -1 || journalWrite() == -1) {
+		free(j->path);
+		j->path = path;
+		j->len = 0;
+		j->due = 0;
+		j->fd = journalCreate(path);
+		return;
+	}
+
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.new", path);
+	long long from = j->save_mark, to = j->size;
+	int fd = journalCreate(tmp);
+
+	char buf[1 << 16];
+	while (fd != -1 && from < to) {
+		long long want = to - from < (long long)sizeof(buf) ? to - from : (long long)sizeof(buf);
+		ssize_t n = pread(j->fd, buf, want, from);
+		struct iovec iov = { buf, n };
+		if (n <= 0 || writeAll(fd, &iov, 1) == -1) {
+			editorSetStatusMessage("Journal off, can't write %s: %s", tmp,
+								   n < 0 ? strerror(errno) : "short read");
+			close(fd);
+			fd = -1;
+			break;
+		}
+		from += n;
+		E.journal.size += n;
+	}
+	if (fd != -1 && (fdatasync(fd) == -1 || rename(tmp, path) == -1)) {
+		close(fd);
+		fd = -1;
+	}
+	if (fd == -1) unlink(tmp);
+
+	close(j->fd);
+	if (strcmp(j->path, path) != 0 || fd == -1) unlink(j->path);
+	free(j->path);
+	j->path = path;
+	j->fd = fd;
+	j->due = 0;
+}
+
+// Nothing left to recover, on a clean quit
+void journalRemove(void) {
+	struct journal *j = &E.journal;
+	if (j->fd == -1) return;
+	close(j->fd);
+	j->fd = -1;
+	unlink(j->path);
+}
+
+/* file i/o */
+
+// Map the whole file and index its newlines in one pass. Rows keep
+// pointing into the mapping until they are edited, so untouched lines
+// never get their own copy of the text.
+int editorOpenMapped(char *filename) {
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return -1;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	E.map = map;
+	E.mapsize = st.st_size;
+
+	if (st.st_size > (long long)cfg.page_memory << 20) {
+		E.paged = 1;
+		if (editorIndexPages() == -1) die("editorOpen");
+		madvise(map, st.st_size, MADV_RANDOM);
+		return 0;
+	}
+
+	char *p = map;
+	char *end = map + st.st_size;
+	while (p < end) {
+		char *nl = memchr(p, '\n', end - p);
+		char *next = nl ? nl + 1 : end;
+		if (nl == NULL) nl = end;
+
+		size_t linelen = nl - p;
+		while (linelen > 0 && p[linelen - 1] == '\r') linelen--;
+		editorInsertRowChars(E.numrows, p, linelen, 1);
+		p = next;
+	}
+	madvise(map, st.st_size, MADV_NORMAL);
+	return 0;
+}
+
+void editorOpen(char *filename) {
+	free(E.filename);
+	E.filename = strdup(filename);
+
+	editorSelectSyntaxHighlight();
+
+	// The file itself is not history
+	E.undo.paused = 1;
+	if (cfg.mmap_open && editorOpenMapped(filename) == 0) {
+		E.undo.paused = 0;
+		E.dirty = 0;
+		return;
+	}
+
+	FILE *fp = fopen(filename, "r");
+	if (!fp) die("fopen");
+
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+
+	while((linelen = getline(&line, &linecap, fp)) != -1) {
+		while (linelen > 0 && (line[linelen - 1] == '\n' ||
+							   line[linelen - 1] == '\r'))
+			linelen--;
+		editorInsertRow(E.numrows, line, linelen);
+	}
+	free(line);
+	fclose(fp);
+	E.undo.paused = 0;
+	E.dirty = 0;
+}
+
+// Write all n buffers of iov, picking up where a short write stopped
+int writeAll(int fd, struct iovec *iov, int n) {
+	while (n > 0) {
+		ssize_t written = writev(fd, iov, n);
+		if (written == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		while (n > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return 0;
+}
+
+// Tell the main thread how far the writer got, waking it up whenever
+// the percentage shown changes
+void editorSaveProgress(struct saveJob *job, long long written) {
+	pthread_mutex_lock(&job->lock);
+	int wake = job->total && written * 100 / job->total != job->written * 100 / job->total;
+	job->written = written;
+	pthread_mutex_unlock(&job->lock);
+	if (wake) {
+		char c = 0;
+		if (write(job->wake_pipe[1], &c, 1) == -1) {}
+	}
+}
+
+// Stream the pages of the job to fd, a batch of iovecs per writev.
+// Pages written from the mapping are dropped from memory once they are
+// out. Rows are taken a leaf at a time under the lock, found from the
+// root again by the child numbers in path, since the main thread swaps
+// nodes of the tree for their copies meanwhile, see rowNodeTouch().
+// Returns the number of bytes written or -1.
+long long editorWriteRows(struct saveJob *job, int fd) {
+	struct iovec iov[SAVE_IOV_BATCH];
+	int n = 0;
+	long long total = 0;
+
+	for (int p = 0; p < job->npages; p++) {
+		struct savePage *sp = &job->pages[p];
+		if (sp->root == NULL) {
+			iov[n].iov_base = sp->chars;
+			iov[n++].iov_len = sp->len;
+			total += sp->len;
+			if (writeAll(fd, iov, n) == -1) return -1;
+			n = 0;
+			editorSaveProgress(job, total);
+			mapDrop(sp->chars - E.map, sp->len);
+			continue;
+		}
+
+		int path[ROWTREE_MAX_DEPTH] = { 0 };
+		int more = 1;
+		while (more) {
+			pthread_mutex_lock(&job->lock);
+			struct rowNode *up[ROWTREE_MAX_DEPTH];
+			struct rowNode *node = sp->root;
+			int depth = 0;
+			while (!node->leaf) {
+				up[depth] = node;
+				node = ROW_INNER(node)->child[path[depth++]];
+			}
+			erow *rows = ROW_LEAF(node)->rows;
+			for (int i = 0; i < node->n; i++) {
+				iov[n].iov_base = rows[i].chars;
+				iov[n++].iov_len = rows[i].size;
+				iov[n].iov_base = "\n";
+				iov[n++].iov_len = 1;
+				total += rows[i].size + 1;
+			}
+
+			// On to the next leaf
+			more = 0;
+			while (depth > 0 && !more) {
+				depth--;
+				if (++path[depth] < up[depth]->n) more = 1;
+				else path[depth] = 0;
+			}
+			pthread_mutex_unlock(&job->lock);
+
+			if (n > SAVE_IOV_BATCH - 2 * ROWTREE_FANOUT ||
+				total - job->written >= SAVE_BATCH_BYTES) {
+				if (writeAll(fd, iov, n) == -1) return -1;
+				n = 0;
+				editorSaveProgress(job, total);
+			}
+		}
+	}
+	if (writeAll(fd, iov, n) == -1) return -1;
+	return total;
+}
+
+// fsync the directory path is in, so that a rename in it is on disk
+void syncDirOf(const char *path) {
+	const char *slash = strrchr(path, '/');
+	char *dir = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+	int fd = open(dir, O_RDONLY);
+	if (fd != -1) {
+		fsync(fd);
+		close(fd);
+	}
+	free(dir);
+}
+
+// Write the rows of the job into a temporary file next to its path and
+// rename it over the path once it is on disk, so a failed save leaves
+// the file as it was. Returns the number of bytes written, or -1 with
+// errno set.
+long long editorWriteFile(struct saveJob *job) {
+	const char *path = job->path;
+	char tmp[PATH_MAX + 32];
+	if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid()) >= (int)sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	struct stat st;
+	int exists = stat(path, &st) == 0;
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) return -1;
+
+	long long len = -1;
+	int ok = (!exists || fchmod(fd, st.st_mode & 07777) == 0) &&
+			 (len = editorWriteRows(job, fd)) != -1 &&
+			 fsync(fd) == 0;
+	if (close(fd) == -1) ok = 0;
+
+	if (ok && rename(tmp, path) == 0) {
+		syncDirOf(path);
+		return len;
+	}
+	int saved_errno = errno;
+	unlink(tmp);
+	errno = saved_errno;
+	return -1;
+}
+
+void *editorSaveWorker(void *arg) {
+	struct saveJob *job = arg;
+	long long len = editorWriteFile(job);
+	int error = len == -1 ? errno : 0;
 
-	E.row[at].size = len;
-	E.row[at].chars = malloc(len + 1);
-	memcpy(E.row[at].chars, s, len);
-	E.row[at].chars[len] = '\0';
+	pthread_mutex_lock(&job->lock);
+	if (len != -1) job->written = len;
+	job->error = error;
+	job->done = 1;
+	pthread_mutex_unlock(&job->lock);
 
-	E.row[at].rsize = 0;
-	E.row[at].render = NULL;
-	E.row[at].hl = NULL;
-	E.row[at].hl_open_comment = 0;
-	editorUpdateRow(&E.row[at]);
+	char c = 0;
+	if (write(job->wake_pipe[1], &c, 1) == -1) {}
+	return NULL;
+}
 
-	E.numrows++;
-	E.dirty++;
+void editorSaveInit(void) {
+	struct saveJob *job = &E.save;
+	memset(job, 0, sizeof(*job));
+	if (pthread_mutex_init(&job->lock, NULL) != 0) die("pthread_mutex_init");
+	if (pipe(job->wake_pipe) == -1) die("pipe");
+	for (int i = 0; i < 2; i++) {
+		int flags = fcntl(job->wake_pipe[i], F_GETFL);
+		if (flags == -1 || fcntl(job->wake_pipe[i], F_SETFL, flags | O_NONBLOCK) == -1)
+			die("fcntl");
+	}
 }
 
-void editorFreeRow(erow *row) {
-	free(row->render);
-	free(row->chars);
-	free(row->hl);
+// Keep chars that the writer may still read until the save is over
+void editorSaveRetire(char *chars) {
+	struct saveJob *job = &E.save;
+	if (job->nretired == job->retired_cap) {
+		job->retired_cap = job->retired_cap ? job->retired_cap * 2 : 64;
+		job->retired = realloc(job->retired, sizeof(char *) * job->retired_cap);
+	}
+	job->retired[job->nretired++] = chars;
 }
 
-void editorDelRow(int at) {
-	if (at < 0 || at >= E.numrows) return;
-	editorFreeRow(&E.row[at]);
-	memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-	for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-	E.numrows--;
-	E.dirty++;
+// Take the file as it is now and write it out on the writer thread. Only
+// the page table is copied: the writer walks the row trees itself, nodes
+// are copied when they change, see rowNodeTouch(), and chars of rows
+// older than the save are copied before they are edited, see
+// editorRowOwn(), so the user can go on editing. Pages of a paged file
+// that were not edited are written straight from the mapping without
+// being loaded.
+void editorSaveStart(char *path) {
+	struct saveJob *job = &E.save;
+	job->pages = malloc(sizeof(struct savePage) * E.npages);
+	if (job->pages == NULL) die("malloc");
+	job->npages = E.npages;
+	job->total = 0;
+	for (int p = 0; p < E.npages; p++) {
+		struct rowPage *pg = &E.pages[p];
+		struct savePage *sp = &job->pages[p];
+		if (E.paged && !pg->dirty) {
+			sp->root = NULL;
+			sp->chars = E.map + pg->offset;
+			sp->len = pg->len;
+			job->total += pg->len;
+		} else {
+			pageLoad(pg);
+			sp->root = pg->root;
+			job->total += pg->bytes;
+		}
+	}
+	job->path = path;
+	job->epoch = E.epoch++;
+	E.journal.save_mark = E.journal.size;
+	job->dirty = E.dirty;
+	job->written = 0;
+	job->done = 0;
+	job->error = 0;
+
+	int err = pthread_create(&job->thread, NULL, editorSaveWorker, job);
+	if (err != 0) {
+		editorSetStatusMessage("Can't save! %s", strerror(err));
+		free(job->pages);
+		job->pages = NULL;
+		free(job->path);
+		job->path = NULL;
+		return;
+	}
+	job->active = 1;
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-	if (at < 0 || at > row->size) at = row->size;
+// Wait for the writer and hand the rows it shared back to the editor
+void editorSaveFinish(void) {
+	struct saveJob *job = &E.save;
+	pthread_join(job->thread, NULL);
+	job->active = 0;
+
+	for (int i = 0; i < job->nretired; i++) free(job->retired[i]);
+	job->nretired = 0;
+	for (int i = 0; i < job->ncopies; i++) free(job->copies[i]);
+	job->ncopies = 0;
+	free(job->pages);
+	job->pages = NULL;
+	free(job->path);
+	job->path = NULL;
+
+	if (job->error) {
+		editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->error));
+	} else {
+		// Edits made while saving are not on disk yet
+		E.dirty -= job->dirty;
+		editorSetStatusMessage("%lld bytes written to disk", job->written);
+		journalSaved();
+		if (E.paged && E.dirty == 0) E.remap = 1;
+	}
 
-	row->chars = realloc(row->chars, row->size + 2);
-	memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-	row->size++;
-	row->chars[at] = c;
-	editorUpdateRow(row);
-	E.dirty++;
+	if (job->again) {
+		job->again = 0;
+		editorSave();
+	}
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-	row->chars = realloc(row->chars, row->size + len + 1);
-	memcpy(&row->chars[row->size], s, len);
-	row->size += len;
-	row->chars[row->size] = '\0';
-	editorUpdateRow(row);
-	E.dirty++;
+// Called when the writer wakes up the event loop
+void editorSaveUpdate(void) {
+	struct saveJob *job = &E.save;
+	char buf[64];
+	while (read(job->wake_pipe[0], buf, sizeof(buf)) > 0) {}
+	if (!job->active) return;
+
+	pthread_mutex_lock(&job->lock);
+	int done = job->done;
+	pthread_mutex_unlock(&job->lock);
+	if (done) editorSaveFinish();
+	E.redraw = 1;
 }
 
-void editorRowDelChar(erow *row, int at) {
-	if (at < 0 || at >= row->size) return;
-	memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-	row->size--;
-	editorUpdateRow(row);
-	E.dirty++;
+// Block until no save is running, e.g. before quitting
+void editorSaveWait(void) {
+	while (E.save.active) editorSaveFinish();
 }
 
-/* editor operations */
+// Percentage of the running save written so far
+int editorSavePercent(void) {
+	struct saveJob *job = &E.save;
+	pthread_mutex_lock(&job->lock);
+	int percent = job->total ? job->written * 100 / job->total : 100;
+	pthread_mutex_unlock(&job->lock);
+	return percent;
+}
 
-void editorInsertChar(int c) {
-	if (E.cy == E.numrows) {
-		editorInsertRow(E.numrows, "", 0);
+void editorSave(void) {
+	if (E.save.active) {
+		E.save.again = 1;
+		editorSetStatusMessage("Still saving, will save again when done");
+		return;
 	}
-	editorRowInsertChar(&E.row[E.cy], E.cx, c);
-	E.cx++;
+
+	if (E.filename == NULL) {
+		E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+		if (E.filename == NULL) {
+			editorSetStatusMessage("Save aborted");
+			return;
+		}
+		editorSelectSyntaxHighlight();
+	}
+
+	// Rows may still point into the mapping of the old file, whose inode
+	// lives on after the rename for as long as it is mapped
+	char *path = realpath(E.filename, NULL);
+	editorSaveStart(path ? path : strdup(E.filename));
 }
 
-void editorInsertNewline(void) {
-	if (E.cx == 0) {
-		editorInsertRow(E.cy, "", 0);
+/* regex */
+
+// Patterns are made of bytes, '.', [classes] with ranges and '^' for
+// negation, \d \w \s and their negations \D \W \S, '*', '+', '?', '|',
+// groups and the anchors '^' and '$'. A backslash takes any other byte
+// literally.
+//
+// A pattern is parsed into a tree and compiled twice into a Thompson NFA
+// program, once for each direction. Programs are never simulated, the
+// DFA states for the sets of instructions they pass through are built
+// the first time the text needs them. After that every byte costs one
+// table lookup, so a search is linear in the text and never backtracks.
+// A DFA whose states fill up is flushed and built again as it goes.
+
+enum regexOp {
+	RE_CHAR = 0,  // take a byte of set
+	RE_SPLIT,     // go on at x and at y
+	RE_JMP,       // go on at x
+	RE_BOL,       // only at the beginning of the text
+	RE_EOL,       // only at the end of the text
+	RE_MATCH
+};
+
+enum regexNodeType {
+	RN_SET = 0,
+	RN_EMPTY,
+	RN_CAT,
+	RN_ALT,
+	RN_STAR,
+	RN_PLUS,
+	RN_QUEST,
+	RN_BOL,
+	RN_EOL
+};
+
+struct regexNode {
+	int type;
+	struct regexNode *a;
+	struct regexNode *b;
+	unsigned char set[32];
+};
+
+struct regexParser {
+	const char *p;
+	int error;
+};
+
+#define REGEX_MAX_INST 4096
+#define DFA_MAX_STATES 1024
+#define DFA_TABLE_SIZE (2 * DFA_MAX_STATES)
+
+// Context of the position a closure is taken at
+#define DFA_CTX_BOL (1<<0)
+#define DFA_CTX_EOL (1<<1)
+
+// Why a scan may stop at a state
+#define DFA_STOP_MATCH (1<<0)
+#define DFA_STOP_DEAD (1<<1)  // no instruction is alive, nothing can match
+
+// Transitions hold the offset of the target's row in dfa->next, so
+// that a byte costs a load and an add. They are -1 until they are built,
+// and negative as well if the scan may stop at the target.
+#define DFA_NEXT_UNKNOWN -1
+#define DFA_NEXT(s) ((s) << 8)
+#define DFA_NEXT_STOP(s) (-2 - DFA_NEXT(s))
+#define DFA_NEXT_STATE(v) ((v) >= 0 ? (v) >> 8 : (-2 - (v)) >> 8)
+
+static void setAdd(unsigned char *set, int c) {
+	set[c >> 3] |= 1 << (c & 7);
+}
+
+static int setHas(const unsigned char *set, int c) {
+	return set[c >> 3] & (1 << (c & 7));
+}
+
+struct regexNode *regexNode(int type, struct regexNode *a, struct regexNode *b) {
+	struct regexNode *n = calloc(1, sizeof(struct regexNode));
+	n->type = type;
+	n->a = a;
+	n->b = b;
+	return n;
+}
+
+void regexNodeFree(struct regexNode *n) {
+	if (n == NULL) return;
+	regexNodeFree(n->a);
+	regexNodeFree(n->b);
+	free(n);
+}
+
+// Add the bytes of the escape \c to set. Returns 0 if it is not a class.
+int regexClassEscape(int c, unsigned char *set) {
+	int lower = tolower(c);
+	if (lower != 'd' && lower != 'w' && lower != 's') return 0;
+
+	int negate = c != lower;
+	for (int i = 0; i < 256; i++) {
+		int in = lower == 'd' ? isdigit(i) :
+				 lower == 'w' ? isalnum(i) || i == '_' : isspace(i);
+		if ((in != 0) != negate) setAdd(set, i);
+	}
+	return 1;
+}
+
+struct regexNode *regexParseAlt(struct regexParser *rp);
+
+struct regexNode *regexParseClass(struct regexParser *rp) {
+	struct regexNode *n = regexNode(RN_SET, NULL, NULL);
+	int negate = *rp->p == '^';
+	if (negate) rp->p++;
+
+	// A ']' right after the '[' is a member
+	const char *first = rp->p;
+	while (*rp->p != ']' || rp->p == first) {
+		if (*rp->p == '\0') {
+			rp->error = 1;
+			return n;
+		}
+		int lo = (unsigned char)*rp->p++;
+		if (lo == '\\' && *rp->p != '\0') {
+			lo = (unsigned char)*rp->p++;
+			if (regexClassEscape(lo, n->set)) continue;
+		}
+		int hi = lo;
+		if (rp->p[0] == '-' && rp->p[1] != ']' && rp->p[1] != '\0') {
+			hi = (unsigned char)rp->p[1];
+			rp->p += 2;
+			if (hi == '\\' && *rp->p != '\0') hi = (unsigned char)*rp->p++;
+		}
+		for (int c = lo; c <= hi; c++) setAdd(n->set, c);
+	}
+	rp->p++;
+
+	if (negate)
+		for (int i = 0; i < 32; i++) n->set[i] = ~n->set[i];
+	return n;
+}
+
+struct regexNode *regexParseAtom(struct regexParser *rp) {
+	int c = (unsigned char)*rp->p++;
+	struct regexNode *n;
+
+	switch (c) {
+		case '(':
+			n = regexParseAlt(rp);
+			if (*rp->p == ')') rp->p++;
+			else rp->error = 1;
+			return n;
+		case '[':
+			return regexParseClass(rp);
+		case '^':
+			return regexNode(RN_BOL, NULL, NULL);
+		case '$':
+			return regexNode(RN_EOL, NULL, NULL);
+		case '*':
+		case '+':
+		case '?':
+			// Nothing to repeat
+			rp->error = 1;
+			return regexNode(RN_EMPTY, NULL, NULL);
+	}
+
+	n = regexNode(RN_SET, NULL, NULL);
+	if (c == '.') {
+		memset(n->set, 0xff, sizeof(n->set));
+	} else if (c == '\\' && *rp->p != '\0') {
+		c = (unsigned char)*rp->p++;
+		if (!regexClassEscape(c, n->set)) setAdd(n->set, c);
 	} else {
-		erow *row = &E.row[E.cy];
-		editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-		row = &E.row[E.cy];  // because of realloc in line above
-		row->size = E.cx;
-		row->chars[row->size] = '\0';
-		editorUpdateRow(row);
+		setAdd(n->set, c);
 	}
-	// Move the cursor one line below and auto indent
-	int temp = 0;
-	for (int i = 0; i < E.row[E.cy].size; i++) {
-		if (E.row[E.cy].chars[i] == '\t') {
-			temp++;
-		} else {
+	return n;
+}
+
+struct regexNode *regexParseRepeat(struct regexParser *rp) {
+	struct regexNode *n = regexParseAtom(rp);
+	while (*rp->p == '*' || *rp->p == '+' || *rp->p == '?') {
+		int c = *rp->p++;
+		n = regexNode(c == '*' ? RN_STAR : c == '+' ? RN_PLUS : RN_QUEST, n, NULL);
+	}
+	return n;
+}
+
+struct regexNode *regexParseCat(struct regexParser *rp) {
+	struct regexNode *n = NULL;
+	while (*rp->p != '\0' && *rp->p != '|' && *rp->p != ')' && !rp->error) {
+		struct regexNode *next = regexParseRepeat(rp);
+		n = n ? regexNode(RN_CAT, n, next) : next;
+	}
+	return n ? n : regexNode(RN_EMPTY, NULL, NULL);
+}
+
+struct regexNode *regexParseAlt(struct regexParser *rp) {
+	struct regexNode *n = regexParseCat(rp);
+	while (*rp->p == '|' && !rp->error) {
+		rp->p++;
+		n = regexNode(RN_ALT, n, regexParseCat(rp));
+	}
+	return n;
+}
+
+// Number of instructions the tree compiles to
+int regexSize(struct regexNode *n) {
+	switch (n->type) {
+		case RN_EMPTY: return 0;
+		case RN_CAT: return regexSize(n->a) + regexSize(n->b);
+		case RN_ALT: return regexSize(n->a) + regexSize(n->b) + 2;
+		case RN_STAR: return regexSize(n->a) + 2;
+		case RN_PLUS:
+		case RN_QUEST: return regexSize(n->a) + 1;
+		default: return 1;
+	}
+}
+
+int regexEmit(struct regexProg *prog, int op) {
+	struct regexInst *inst = &prog->inst[prog->ninst];
+	memset(inst, 0, sizeof(struct regexInst));
+	inst->op = op;
+	return prog->ninst++;
+}
+
+// Compile the tree into prog. The reversed program takes the text from
+// its end, so concatenations run backwards and the anchors swap.
+void regexCompileNode(struct regexProg *prog, struct regexNode *n, int reverse) {
+	int split, jmp, start;
+
+	switch (n->type) {
+		case RN_SET:
+			split = regexEmit(prog, RE_CHAR);
+			memcpy(prog->inst[split].set, n->set, sizeof(n->set));
+			break;
+		case RN_CAT:
+			regexCompileNode(prog, reverse ? n->b : n->a, reverse);
+			regexCompileNode(prog, reverse ? n->a : n->b, reverse);
+			break;
+		case RN_ALT:
+			split = regexEmit(prog, RE_SPLIT);
+			prog->inst[split].x = prog->ninst;
+			regexCompileNode(prog, n->a, reverse);
+			jmp = regexEmit(prog, RE_JMP);
+			prog->inst[split].y = prog->ninst;
+			regexCompileNode(prog, n->b, reverse);
+			prog->inst[jmp].x = prog->ninst;
+			break;
+		case RN_STAR:
+			split = regexEmit(prog, RE_SPLIT);
+			prog->inst[split].x = prog->ninst;
+			regexCompileNode(prog, n->a, reverse);
+			jmp = regexEmit(prog, RE_JMP);
+			prog->inst[jmp].x = split;
+			prog->inst[split].y = prog->ninst;
 			break;
+		case RN_PLUS:
+			start = prog->ninst;
+			regexCompileNode(prog, n->a, reverse);
+			split = regexEmit(prog, RE_SPLIT);
+			prog->inst[split].x = start;
+			prog->inst[split].y = prog->ninst;
+			break;
+		case RN_QUEST:
+			split = regexEmit(prog, RE_SPLIT);
+			prog->inst[split].x = prog->ninst;
+			regexCompileNode(prog, n->a, reverse);
+			prog->inst[split].y = prog->ninst;
+			break;
+		case RN_BOL:
+			regexEmit(prog, reverse ? RE_EOL : RE_BOL);
+			break;
+		case RN_EOL:
+			regexEmit(prog, reverse ? RE_BOL : RE_EOL);
+			break;
+	}
+}
+
+// The byte a node stands for, -1 if it is not a single byte
+int regexSingleByte(struct regexNode *n) {
+	if (n->type != RN_SET) return -1;
+	int c = -1;
+	for (int i = 0; i < 256; i++) {
+		if (!setHas(n->set, i)) continue;
+		if (c != -1) return -1;
+		c = i;
+	}
+	return c;
+}
+
+// The longest run of single bytes in the top level concatenation of
+// the tree, which every match has to contain
+void regexMust(struct regex *re, struct regexNode *tree) {
+	int n = 1;
+	for (struct regexNode *t = tree; t->type == RN_CAT; t = t->a) n++;
+
+	// Concatenations nest to the left, so the chain is filled from its end
+	int *bytes = malloc(sizeof(int) * n);
+	struct regexNode *t = tree;
+	for (int i = n - 1; i > 0; i--, t = t->a) bytes[i] = regexSingleByte(t->b);
+	bytes[0] = regexSingleByte(t);
+
+	int best = 0, best_at = 0;
+	for (int i = 0, run = 0; i < n; i++) {
+		run = bytes[i] == -1 ? 0 : run + 1;
+		if (run > best) {
+			best = run;
+			best_at = i + 1 - run;
 		}
 	}
 
-	E.cy++;
-	E.cx = cfg.tab_stop * temp;
+	re->must = malloc(best + 1);
+	for (int i = 0; i < best; i++) re->must[i] = bytes[best_at + i];
+	re->must_len = best;
+	free(bytes);
 }
 
-void editorDelChar(void) {
-	if (E.cy == E.numrows) return;
-	if (E.cx == 0 && E.cy == 0) return;
+void regexFree(struct regex *re) {
+	free(re->fwd.inst);
+	free(re->rev.inst);
+	free(re->must);
+	re->fwd.inst = NULL;
+	re->rev.inst = NULL;
+	re->must = NULL;
+}
 
-	erow *row = &E.row[E.cy];
-	if (E.cx > 0) {
-		editorRowDelChar(row, E.cx - 1);
-		E.cx--;
-	} else {
-		E.cx = E.row[E.cy - 1].size;
-		editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-		editorDelRow(E.cy);
-		E.cy--;
+// Compile pattern into re. Returns -1 if it is not a valid regex.
+int regexCompile(struct regex *re, const char *pattern) {
+	static int next_id = 0;
+
+	struct regexParser rp = { pattern, 0 };
+	struct regexNode *tree = regexParseAlt(&rp);
+	if (*rp.p != '\0') rp.error = 1;  // a ')' without '('
+
+	int ninst = rp.error ? 0 : regexSize(tree) + 1;
+	if (rp.error || ninst > REGEX_MAX_INST) {
+		regexNodeFree(tree);
+		return -1;
+	}
+
+	struct regexProg *progs[2] = { &re->fwd, &re->rev };
+	for (int i = 0; i < 2; i++) {
+		progs[i]->inst = malloc(sizeof(struct regexInst) * ninst);
+		progs[i]->ninst = 0;
+		regexCompileNode(progs[i], tree, i);
+		regexEmit(progs[i], RE_MATCH);
+	}
+	regexMust(re, tree);
+	re->id = ++next_id;
+	regexNodeFree(tree);
+	return 0;
+}
+
+// Add pc and the instructions reachable from it without taking a byte
+// to set, which holds n of them already. Returns the new size of set.
+int regexClosure(struct regexDfa *dfa, int pc, int ctx, int *set, int n) {
+	struct regexInst *inst = dfa->prog->inst;
+	int sp = 0;
+	if (!dfa->mark[pc]) {
+		dfa->mark[pc] = 1;
+		dfa->stack[sp++] = pc;
+	}
+
+	while (sp > 0) {
+		pc = dfa->stack[--sp];
+		int next[2];
+		int nnext = 0;
+		switch (inst[pc].op) {
+			case RE_JMP:
+				next[nnext++] = inst[pc].x;
+				break;
+			case RE_SPLIT:
+				next[nnext++] = inst[pc].x;
+				next[nnext++] = inst[pc].y;
+				break;
+			case RE_BOL:
+				// Never true again once the position is past it
+				if (ctx & DFA_CTX_BOL) next[nnext++] = pc + 1;
+				break;
+			case RE_EOL:
+				// Kept in the set, the end of the text may still come
+				if (ctx & DFA_CTX_EOL) next[nnext++] = pc + 1;
+				else set[n++] = pc;
+				break;
+			default:
+				set[n++] = pc;
+				break;
+		}
+		for (int i = 0; i < nnext; i++) {
+			if (dfa->mark[next[i]]) continue;
+			dfa->mark[next[i]] = 1;
+			dfa->stack[sp++] = next[i];
+		}
+	}
+	return n;
+}
+
+void regexClearMarks(struct regexDfa *dfa) {
+	memset(dfa->mark, 0, dfa->prog->ninst);
+}
+
+void regexDfaFlush(struct regexDfa *dfa) {
+	for (int i = 0; i < dfa->nstates; i++) free(dfa->states[i].pcs);
+	dfa->nstates = 0;
+	dfa->flushes++;
+	dfa->start[0] = dfa->start[1] = -1;
+	for (int i = 0; i < DFA_TABLE_SIZE; i++) dfa->table[i] = -1;
+}
+
+void regexDfaInit(struct regexDfa *dfa, struct regexProg *prog, int anchored) {
+	if (dfa->table == NULL) dfa->table = malloc(sizeof(int) * DFA_TABLE_SIZE);
+	regexDfaFlush(dfa);
+	dfa->prog = prog;
+	dfa->anchored = anchored;
+
+	int n = prog->ninst;
+	dfa->mark = realloc(dfa->mark, n);
+	dfa->stack = realloc(dfa->stack, sizeof(int) * n);
+	dfa->set = realloc(dfa->set, sizeof(int) * n);
+	dfa->eol_set = realloc(dfa->eol_set, sizeof(int) * n);
+	memset(dfa->mark, 0, n);
+}
+
+static int intCmp(const void *a, const void *b) {
+	int x = *(const int *)a, y = *(const int *)b;
+	return (x > y) - (x < y);
+}
+
+// Index of the state for the n instructions in dfa->set, which is built
+// if it is not there yet
+int regexDfaState(struct regexDfa *dfa, int n) {
+	qsort(dfa->set, n, sizeof(int), intCmp);
+
+	unsigned int hash = 2166136261u;
+	for (int i = 0; i < n; i++) hash = (hash ^ dfa->set[i]) * 16777619u;
+	int slot = hash % DFA_TABLE_SIZE;
+	for (; dfa->table[slot] != -1; slot = (slot + 1) % DFA_TABLE_SIZE) {
+		struct dfaState *s = &dfa->states[dfa->table[slot]];
+		if (s->npcs == n && memcmp(s->pcs, dfa->set, sizeof(int) * n) == 0)
+			return dfa->table[slot];
+	}
+
+	if (dfa->nstates == DFA_MAX_STATES) {
+		regexDfaFlush(dfa);
+		return regexDfaState(dfa, n);
+	}
+	if (dfa->nstates == dfa->states_cap) {
+		dfa->states_cap = dfa->states_cap ? dfa->states_cap * 2 : 16;
+		dfa->states = realloc(dfa->states, sizeof(struct dfaState) * dfa->states_cap);
+		dfa->next = realloc(dfa->next, sizeof(int) * 256 * dfa->states_cap);
+		dfa->stop = realloc(dfa->stop, dfa->states_cap);
+	}
+
+	struct dfaState *s = &dfa->states[dfa->nstates];
+	s->pcs = malloc(sizeof(int) * (n ? n : 1));
+	memcpy(s->pcs, dfa->set, sizeof(int) * n);
+	s->npcs = n;
+	memset(&dfa->next[DFA_NEXT(dfa->nstates)], -1, sizeof(int) * 256);
+
+	// Instructions waiting for the end of the text get there now
+	int neol = 0;
+	for (int i = 0; i < n; i++) {
+		if (dfa->prog->inst[s->pcs[i]].op == RE_EOL)
+			neol = regexClosure(dfa, s->pcs[i], DFA_CTX_EOL, dfa->eol_set, neol);
+	}
+	regexClearMarks(dfa);
+
+	s->match = 0;
+	s->eol_match = 0;
+	for (int i = 0; i < n; i++)
+		if (dfa->prog->inst[s->pcs[i]].op == RE_MATCH) s->match = 1;
+	for (int i = 0; i < neol; i++)
+		if (dfa->prog->inst[dfa->eol_set[i]].op == RE_MATCH) s->eol_match = 1;
+	s->eol_match |= s->match;
+	dfa->stop[dfa->nstates] = (s->match ? DFA_STOP_MATCH : 0) |
+							  (n == 0 ? DFA_STOP_DEAD : 0);
+
+	dfa->table[slot] = dfa->nstates;
+	return dfa->nstates++;
+}
+
+int regexDfaStart(struct regexDfa *dfa, int bol) {
+	if (dfa->start[bol] == -1) {
+		int n = regexClosure(dfa, 0, bol ? DFA_CTX_BOL : 0, dfa->set, 0);
+		regexClearMarks(dfa);
+		int start = regexDfaState(dfa, n);
+		dfa->start[bol] = start;
+	}
+	return dfa->start[bol];
+}
+
+// State after from takes the byte c
+int regexDfaStep(struct regexDfa *dfa, int from, unsigned char c) {
+	int known = dfa->next[DFA_NEXT(from) + c];
+	if (known != DFA_NEXT_UNKNOWN) return DFA_NEXT_STATE(known);
+
+	struct dfaState *s = &dfa->states[from];
+	int n = 0;
+	for (int i = 0; i < s->npcs; i++) {
+		struct regexInst *inst = &dfa->prog->inst[s->pcs[i]];
+		if (inst->op == RE_CHAR && setHas(inst->set, c))
+			n = regexClosure(dfa, s->pcs[i] + 1, 0, dfa->set, n);
+	}
+	// Unanchored, a match may also start right here
+	if (!dfa->anchored) n = regexClosure(dfa, 0, 0, dfa->set, n);
+	regexClearMarks(dfa);
+
+	int flushes = dfa->flushes;
+	int to = regexDfaState(dfa, n);
+	if (dfa->flushes == flushes)
+		dfa->next[DFA_NEXT(from) + c] = dfa->stop[to] ? DFA_NEXT_STOP(to) : DFA_NEXT(to);
+	return to;
+}
+
+void regexCacheSync(struct regex *re, struct regexCache *cache) {
+	if (cache->id == re->id) return;
+	regexDfaInit(&cache->any, &re->fwd, 0);
+	regexDfaInit(&cache->back, &re->rev, 0);
+	regexDfaInit(&cache->longest, &re->fwd, 1);
+	cache->id = re->id;
+}
+
+// Offset of the leftmost-longest match of re in text, -1 if there is
+// none. Its length goes to mlen. If mlen is NULL the text is only
+// scanned up to the first position a match ends at and 0 is returned
+// if there is one.
+int regexSearch(struct regex *re, struct regexCache *cache,
+				const char *text, int len, int *mlen) {
+	regexCacheSync(re, cache);
+	const unsigned char *t = (const unsigned char *)text;
+
+	struct regexDfa *dfa = &cache->any;
+	int s = regexDfaStart(dfa, 1);
+	int i = 0;
+	if (!dfa->stop[s]) {
+		int at = DFA_NEXT(s);
+		while (i < len) {
+			int next = dfa->next[at + t[i]];
+			if (next < 0) {
+				s = regexDfaStep(dfa, at >> 8, t[i++]);
+				if (dfa->stop[s]) break;
+				at = DFA_NEXT(s);
+			} else {
+				at = next;
+				i++;
+			}
+		}
+		if (i == len && !dfa->stop[s]) s = at >> 8;
+	}
+	if (dfa->stop[s] & DFA_STOP_DEAD) return -1;
+	if (!(i == len ? dfa->states[s].eol_match : dfa->states[s].match)) return -1;
+	if (mlen == NULL) return 0;
+
+	// The leftmost start is the last position the reversed program
+	// matches at when it runs over the whole text from its end
+	dfa = &cache->back;
+	s = regexDfaStart(dfa, 1);
+	int start = dfa->states[s].match ? len : -1;
+	for (i = len; i > 0; ) {
+		i--;
+		s = regexDfaStep(dfa, s, t[i]);
+		if (dfa->states[s].match) start = i;
+	}
+	if (dfa->states[s].eol_match) start = 0;
+	if (start == -1) return -1;
+
+	// The longest match from there
+	dfa = &cache->longest;
+	s = regexDfaStart(dfa, start == 0);
+	int end = dfa->states[s].match ? start : -1;
+	for (i = start; i < len && !(dfa->stop[s] & DFA_STOP_DEAD); ) {
+		s = regexDfaStep(dfa, s, t[i++]);
+		if (dfa->states[s].match) end = i;
+	}
+	if (i == len && dfa->states[s].eol_match) end = len;
+	if (end == -1) return -1;
+
+	*mlen = end - start;
+	return start;
+}
+
+/* find */
+
+// While a query is typed every prefix keeps the rows it occurs in. A
+// longer query only looks at the rows of the shorter one and backspace
+// returns to the set that is already there, so only the first character
+// scans the whole file. Rows can not change while the prompt is open.
+//
+// A regex query is compiled to a DFA instead, see the regex section.
+// Adding to a regex does not make it match less, so it only keeps the
+// level of the whole query.
+//
+// Levels with many candidates are scanned by a pool of worker threads
+// while the prompt keeps taking keys. Workers take chunks of candidates
+// in order and the event loop appends every chunk to the level once the
+// chunks before it are done, so the level stays sorted while it grows.
+// Workers only read the row tree and chars, never render, which the
+// main thread rebuilds as it likes. The next key cancels the scan.
+//
+// A paged file is scanned page by page without loading the pages, see
+// searchPagedRow(), and what was read of the mapping is dropped again.
+
+#define SEARCH_CHUNK_ROWS 4096
+#define SEARCH_PARALLEL_MIN_ROWS (4 * SEARCH_CHUNK_ROWS)
+#define SEARCH_MAX_WORKERS 16
+
+void searchCompile(struct searchSession *ss, const char *query, int qlen) {
+	free(ss->query);
+	ss->query = malloc(qlen + 1);
+	memcpy(ss->query, query, qlen + 1);
+	ss->qlen = qlen;
+
+	// A regex gets the shifts for the bytes all of its matches contain,
+	// rows without them are skipped before the DFA runs
+	if (ss->regex) {
+		regexFree(&ss->re);
+		ss->bad = regexCompile(&ss->re, query) == -1;
+		if (ss->bad) return;
+		query = ss->re.must;
+		qlen = ss->re.must_len;
+	}
+
+	for (int i = 0; i < 256; i++) ss->skip[i] = qlen;
+	for (int i = 0; i < qlen - 1; i++)
+		ss->skip[(unsigned char)query[i]] = qlen - 1 - i;
+}
+
+// Offset of the first occurrence of q in text, -1 if none. Short
+// strings jump between occurrences of their first byte with memchr,
+// longer ones use Horspool's shifts.
+int searchLiteral(struct searchSession *ss, const char *q, int qlen,
+				  const char *text, int len) {
+	if (qlen == 0) return 0;
+	if (qlen > len) return -1;
+
+	if (qlen < 4) {
+		const char *p = text, *end = text + len - qlen + 1;
+		while (p < end && (p = memchr(p, q[0], end - p)) != NULL) {
+			if (memcmp(p + 1, q + 1, qlen - 1) == 0) return p - text;
+			p++;
+		}
+		return -1;
+	}
+
+	unsigned char last = q[qlen - 1];
+	for (int i = 0; i <= len - qlen;) {
+		unsigned char c = text[i + qlen - 1];
+		if (c == last && memcmp(&text[i], q, qlen - 1) == 0) return i;
+		i += ss->skip[c];
+	}
+	return -1;
+}
+
+// Offset of the first match of the query in text, -1 if none. Its
+// length goes to mlen unless that is NULL.
+int searchText(struct searchSession *ss, struct searchWorkspace *ws,
+			   const char *text, int len, int *mlen) {
+	if (ss->regex) {
+		if (searchLiteral(ss, ss->re.must, ss->re.must_len, text, len) == -1)
+			return -1;
+		return regexSearch(&ss->re, &ws->re, text, len, mlen);
+	}
+
+	if (mlen) *mlen = ss->qlen;
+	return searchLiteral(ss, ss->query, ss->qlen, text, len);
+}
+
+// The bytes a row is searched in: the chars if they render the same
+// because there are no tabs, a render in the scratch buffer otherwise
+char *searchRowText(erow *row, int *len, struct searchWorkspace *ws) {
+	if (memchr(row->chars, '\t', row->size) == NULL) {
+		*len = row->size;
+		return row->chars;
+	}
+
+	int need = editorRenderSize(row, NULL, NULL);
+	if (need > ws->scratch_cap) {
+		ws->scratch_cap = need * 2;
+		ws->scratch = realloc(ws->scratch, ws->scratch_cap);
+	}
+	*len = editorRenderChars(row, ws->scratch, NULL, NULL);
+	return ws->scratch;
+}
+
+// Let the kernel drop the part of the mapping the cursor went over
+void searchCursorLeave(struct searchCursor *c) {
+	if (c->page != -1 && c->s) mapDrop(c->from - E.map, c->s - c->from);
+	c->page = -1;
+}
+
+// Row at of a paged file, at or after the row the cursor is at. Scanning
+// loads no page: edited pages are loaded anyway and read from their
+// tree, the rows of the others are read from the mapping into tmp. So
+// workers can scan while the main thread loads and unloads pages.
+erow *searchPagedRow(struct searchCursor *c, int at, erow *tmp) {
+	struct rowPage *pg = c->page == -1 ? NULL : &E.pages[c->page];
+	if (pg == NULL || at < c->at || at >= c->first + pg->count) {
+		searchCursorLeave(c);
+		int i = at;
+		c->page = pageFindLine(&i);
+		pg = &E.pages[c->page];
+		c->first = c->at = at - i;
+		c->s = c->from = pg->dirty ? NULL : E.map + pg->offset;
+	}
+	if (c->s == NULL) return pageRowAt(pg, at - c->first);
+
+	// Lines before the last one of the page end in a newline
+	char *end = E.map + pg->offset + pg->len;
+	for (; c->at < at; c->at++) c->s = (char *)memchr(c->s, '\n', end - c->s) + 1;
+
+	char *nl = memchr(c->s, '\n', end - c->s);
+	int len = (nl ? nl : end) - c->s;
+	while (len > 0 && c->s[len - 1] == '\r') len--;
+	tmp->chars = c->s;
+	tmp->size = len;
+	return tmp;
+}
+
+// Put the candidates in [start, end) that contain the query into out.
+// from lists the candidate rows, NULL means all rows. Returns the number
+// of rows found.
+int searchScan(struct searchSession *ss, const int *from, int start, int end,
+			   int *out, struct searchWorkspace *ws) {
+	int found = 0;
+	erow *row = NULL;
+	int row_at = -1;
+	struct searchCursor cursor = { -1, 0, 0, NULL, NULL };
+	erow tmp;
+	for (int i = start; i < end; i++) {
+		int at = from ? from[i] : i;
+		if (E.paged) {
+			row = searchPagedRow(&cursor, at, &tmp);
+		} else {
+			row = (row && row_at + 1 == at) ? editorRowNext(row) : editorRowAt(at);
+			row_at = at;
+		}
+
+		int len;
+		char *text = searchRowText(row, &len, ws);
+		if (searchText(ss, ws, text, len, NULL) != -1) out[found++] = at;
+	}
+	searchCursorLeave(&cursor);
+	return found;
+}
+
+void *searchWorker(void *arg) {
+	struct searchSession *ss = arg;
+	struct searchJob *job = &ss->job;
+	struct searchWorkspace ws;
+	memset(&ws, 0, sizeof(ws));
+
+	pthread_mutex_lock(&ss->lock);
+	while (1) {
+		while (!job->active || job->next_chunk == job->nchunks)
+			pthread_cond_wait(&ss->work, &ss->lock);
+
+		int chunk = job->next_chunk++;
+		int start = chunk * SEARCH_CHUNK_ROWS;
+		int end = job->n - start < SEARCH_CHUNK_ROWS ? job->n : start + SEARCH_CHUNK_ROWS;
+		const int *from = job->from;
+		job->busy++;
+		pthread_mutex_unlock(&ss->lock);
+
+		int *rows = malloc(sizeof(int) * (end - start));
+		int n = searchScan(ss, from, start, end, rows, &ws);
+
+		// A cancelled job waits for busy to drop before it is torn down,
+		// so the chunk still belongs to it
+		pthread_mutex_lock(&ss->lock);
+		job->chunk_rows[chunk] = rows;
+		job->chunk_n[chunk] = n;
+		job->found += n;
+		if (--job->busy == 0) pthread_cond_broadcast(&ss->idle);
+		if (write(ss->wake_pipe[1], "", 1) == -1) {
+			// The pipe is full, a wakeup is pending anyway
+		}
+	}
+	return NULL;
+}
+
+void searchStartWorkers(struct searchSession *ss) {
+	if (ss->nworkers > 0) return;
+
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) n = 1;
+	if (n > SEARCH_MAX_WORKERS) n = SEARCH_MAX_WORKERS;
+
+	if (pipe(ss->wake_pipe) == -1) die("pipe");
+	for (int i = 0; i < 2; i++)
+		fcntl(ss->wake_pipe[i], F_SETFL, O_NONBLOCK);
+
+	pthread_mutex_init(&ss->lock, NULL);
+	pthread_cond_init(&ss->work, NULL);
+	pthread_cond_init(&ss->idle, NULL);
+	ss->workers = malloc(sizeof(pthread_t) * n);
+	for (int i = 0; i < n; i++) {
+		int err = pthread_create(&ss->workers[i], NULL, searchWorker, ss);
+		if (err != 0) {
+			errno = err;
+			die("pthread_create");
+		}
+	}
+	ss->nworkers = n;
+}
+
+// Let the workers scan n candidates into the top level
+void searchStartJob(struct searchSession *ss, const int *from, int n) {
+	struct searchJob *job = &ss->job;
+	searchStartWorkers(ss);
+
+	job->from = from;
+	job->n = n;
+	job->nchunks = (n + SEARCH_CHUNK_ROWS - 1) / SEARCH_CHUNK_ROWS;
+	job->next_chunk = 0;
+	job->merged = 0;
+	job->found = 0;
+	job->chunk_rows = calloc(job->nchunks, sizeof(int *));
+	job->chunk_n = malloc(sizeof(int) * job->nchunks);
+	for (int i = 0; i < job->nchunks; i++) job->chunk_n[i] = -1;
+
+	pthread_mutex_lock(&ss->lock);
+	job->active = 1;
+	pthread_cond_broadcast(&ss->work);
+	pthread_mutex_unlock(&ss->lock);
+}
+
+void searchFreeJob(struct searchJob *job) {
+	for (int i = job->merged; i < job->nchunks; i++) free(job->chunk_rows[i]);
+	free(job->chunk_rows);
+	free(job->chunk_n);
+	job->chunk_rows = NULL;
+	job->chunk_n = NULL;
+}
+
+// Stop scanning and wait until no worker looks at the rows anymore. The
+// level stays incomplete.
+void searchCancel(struct searchSession *ss) {
+	struct searchJob *job = &ss->job;
+	if (!job->active) return;
+
+	pthread_mutex_lock(&ss->lock);
+	job->active = 0;
+	while (job->busy > 0) pthread_cond_wait(&ss->idle, &ss->lock);
+	pthread_mutex_unlock(&ss->lock);
+	searchFreeJob(job);
+}
+
+// Append the chunks scanned so far to the top level, in order. Returns
+// 1 if the level or the number of rows found changed.
+int searchCollect(struct searchSession *ss) {
+	struct searchJob *job = &ss->job;
+	if (!job->active) return 0;
+
+	char buf[64];
+	while (read(ss->wake_pipe[0], buf, sizeof(buf)) > 0);
+
+	struct searchLevel *top = &ss->levels[ss->nlevels - 1];
+	pthread_mutex_lock(&ss->lock);
+	while (job->merged < job->nchunks && job->chunk_n[job->merged] != -1) {
+		int n = job->chunk_n[job->merged];
+		memcpy(&top->rows[top->nrows], job->chunk_rows[job->merged], sizeof(int) * n);
+		top->nrows += n;
+		free(job->chunk_rows[job->merged++]);
+	}
+	if (job->merged == job->nchunks) {
+		job->active = 0;
+		top->done = 1;
+	}
+	pthread_mutex_unlock(&ss->lock);
+
+	if (top->done) searchFreeJob(job);
+	return 1;
+}
+
+// Make the top level hold the rows containing query
+void searchNarrow(struct searchSession *ss, const char *query, int qlen) {
+	struct searchLevel *top = ss->nlevels ? &ss->levels[ss->nlevels - 1] : NULL;
+	if (top && top->qlen == qlen && memcmp(ss->query, query, qlen) == 0) return;
+	searchCancel(ss);
+
+	// Drop levels of prefixes the query does not start with anymore and
+	// one whose scan was cancelled
+	while (ss->nlevels > 0) {
+		top = &ss->levels[ss->nlevels - 1];
+		if (top->done && top->qlen <= qlen && memcmp(ss->query, query, top->qlen) == 0
+			&& (!ss->regex || top->qlen == qlen))
+			break;
+		free(top->rows);
+		ss->nlevels--;
+	}
+	searchCompile(ss, query, qlen);
+	if (qlen == 0 || ss->bad) return;
+	if (ss->nlevels > 0 && ss->levels[ss->nlevels - 1].qlen == qlen) return;
+
+	struct searchLevel *from = ss->nlevels ? &ss->levels[ss->nlevels - 1] : NULL;
+	const int *candidates = from ? from->rows : NULL;
+	int n = from ? from->nrows : E.numrows;
+
+	if (ss->nlevels == ss->levels_cap) {
+		ss->levels_cap = ss->levels_cap ? ss->levels_cap * 2 : 8;
+		ss->levels = realloc(ss->levels, sizeof(struct searchLevel) * ss->levels_cap);
+	}
+	struct searchLevel *level = &ss->levels[ss->nlevels++];
+	level->qlen = qlen;
+	level->rows = malloc(sizeof(int) * (n ? n : 1));
+	level->nrows = 0;
+	level->done = 0;
+
+	if (n < SEARCH_PARALLEL_MIN_ROWS) {
+		level->nrows = searchScan(ss, candidates, 0, n, level->rows, &ss->ws);
+		level->done = 1;
+	} else {
+		searchStartJob(ss, candidates, n);
 	}
 }
 
-/* file i/o */
+// Next row after from in direction that contains the query, wrapping
+// around the file. Returns -1 if there is none. While the level is
+// still scanned it does not wrap and stays at from instead.
+int searchNextRow(struct searchSession *ss, int from, int direction) {
+	if (ss->bad) return -1;
+	if (ss->nlevels == 0) {
+		// The empty query is everywhere
+		if (E.numrows == 0) return -1;
+		return (from + direction + E.numrows) % E.numrows;
+	}
 
-char *editorRowsToString(int *buflen) {
-	int totlen = 0;
-	int i = 0;
-	for (i = 0; i < E.numrows; i++) {
-		totlen += E.row[i].size + 1;
+	struct searchLevel *top = &ss->levels[ss->nlevels - 1];
+
+	// First candidate after from
+	int lo = 0, hi = top->nrows;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (top->rows[mid] <= from) lo = mid + 1;
+		else hi = mid;
 	}
-	*buflen = totlen;
-	char *buf = malloc(totlen);
-	char *p = buf;
-	for (i = 0; i < E.numrows; i++) {
-		memcpy(p, E.row[i].chars, E.row[i].size);
-		p += E.row[i].size;
-		*p = '\n';
-		p++;
+	if (direction == 1) {
+		if (lo < top->nrows) return top->rows[lo];
+		if (!top->done) return from;
+		return top->nrows ? top->rows[0] : -1;
 	}
 
-	return buf;
+	// Last candidate before from
+	while (lo > 0 && top->rows[lo - 1] >= from) lo--;
+	if (lo > 0) return top->rows[lo - 1];
+	if (!top->done) return from;
+	return top->nrows ? top->rows[top->nrows - 1] : -1;
 }
 
-void editorOpen(char *filename) {
-	free(E.filename);
-	E.filename = strdup(filename);
-
-	editorSelectSyntaxHighlight();
-
-	FILE *fp = fopen(filename, "r");
-	if (!fp) die("fopen");
-
-	char *line = NULL;
-	size_t linecap = 0;
-	ssize_t linelen;
+void searchEnd(struct searchSession *ss) {
+	searchCancel(ss);
+	for (int i = 0; i < ss->nlevels; i++) free(ss->levels[i].rows);
+	ss->nlevels = 0;
+	ss->last_match = -1;
+	ss->direction = 1;
+	ss->bad = 0;
+}
 
-	while((linelen = getline(&line, &linecap, fp)) != -1) {
-		while (linelen > 0 && (line[linelen - 1] == '\n' ||
-							   line[linelen - 1] == '\r'))
-			linelen--;
-		editorInsertRow(E.numrows, line, linelen);
+// "match i of N" for the status bar while a query is typed, with a "+"
+// while workers are still counting. Empty if there is no query.
+void searchStatus(struct searchSession *ss, char *buf, int size) {
+	buf[0] = '\0';
+	if (ss->bad && ss->qlen > 0) {
+		snprintf(buf, size, "bad regex | ");
+		return;
 	}
-	free(line);
-	fclose(fp);
-	E.dirty = 0;
-}
+	if (ss->nlevels == 0) return;
+
+	struct searchLevel *top = &ss->levels[ss->nlevels - 1];
+	int total = top->nrows;
+	if (!top->done) {
+		pthread_mutex_lock(&ss->lock);
+		total = ss->job.found;
+		pthread_mutex_unlock(&ss->lock);
+	}
+	const char *more = top->done ? "" : "+";
 
-void editorSave(void) {
-	if (E.filename == NULL) {
-		E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-		if (E.filename == NULL) {
-			editorSetStatusMessage("Save aborted");
-			return;
-		}
-		editorSelectSyntaxHighlight();
+	if (ss->last_match == -1) {
+		snprintf(buf, size, "%d%s matches | ", total, more);
+		return;
+	}
+	int lo = 0, hi = top->nrows;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (top->rows[mid] < ss->last_match) lo = mid + 1;
+		else hi = mid;
 	}
+	snprintf(buf, size, "match %d of %d%s | ", lo + 1, total, more);
+}
 
-	int len; 
-	char *buf = editorRowsToString(&len);
+// Put the cursor on the first occurrence of the query in row current,
+// or only take the highlight away if current is -1
+void searchShowMatch(struct searchSession *ss, int current) {
+	if (E.match_row != -1) editorRowAt(E.match_row)->damaged = 1;
+	E.match_row = -1;
+	if (current == -1) return;
 
-	int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-	if (fd != -1) {
-		if (ftruncate(fd, len) != -1) {
-			if (write(fd, buf, len) == len) {
-				close(fd);
-				free(buf);
-				E.dirty = 0;
-				editorSetStatusMessage("%d bytes written to disk", len);
-				return;
-			}
-		}
-		close(fd);
-	}
+	erow *row = editorRowAt(current);
+	int len;
+	char *text = searchRowText(row, &len, &ss->ws);
+	int mlen;
+	int rx = searchText(ss, &ss->ws, text, len, &mlen);
+
+	editorRowRender(row, current);
+	ss->last_match = current;
+	E.cy = current;
+	E.cx = editorRowRenderToCx(row, rx);
+	//E.rowoff = i - E.screenrows / 3;
+	E.rowoff = E.numrows;
+
+	row->damaged = 1;
+	E.match_row = current;
+	E.match_rx = rx;
+	E.match_len = mlen;
+}
 
-	free(buf);
-	editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+// Called by the event loop when workers scanned more rows. The first
+// match is shown as soon as it is known, the status bar counts the rest.
+void editorSearchUpdate(void) {
+	struct searchSession *ss = &E.search;
+	if (!searchCollect(ss)) return;
+	if (ss->last_match == -1) searchShowMatch(ss, searchNextRow(ss, -1, 1));
+	E.redraw = 1;
 }
 
-/* find */
 void editorFindCallback(char *query, int key) {
-	static int last_match = -1;  // -1: no match
-	static int direction = 1;  // -1: backward search, 1: forward search
-
-	static int saved_hl_line;
-	static char *saved_hl = NULL;
-
-	if (saved_hl) {
-		memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-		free(saved_hl);
-		saved_hl = NULL;
-	}
+	struct searchSession *ss = &E.search;
+	// Pages of the matches that were shown, the prompt keeps the event
+	// loop from doing it
+	editorTrimPages();
 
 	if (key == '\r' || key == '\x1b') {
-		last_match = -1;
-		direction = 1;
+		searchShowMatch(ss, -1);
+		searchEnd(ss);
 		return;
 	} else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-		direction = 1;
+		ss->direction = 1;
 	} else if (key == ARROW_LEFT|| key == ARROW_UP) {
-		direction = -1;
+		ss->direction = -1;
 	} else {
-		last_match = -1;
-		direction = 1;
-	}
-
-	if (last_match == -1) direction = 1;
-	int current = last_match;
-	for (int i = 0; i < E.numrows; i++) {
-		current += direction;
-		if (current == -1) current = E.numrows - 1;
-		else if (current == E.numrows) current = 0;
-
-		erow *row = &E.row[current];
-		char *match = strstr(row->render, query);
-		if (match) {
-			last_match = current;
-			E.cy = current;
-			E.cx = editorRowRxToCx(row, match - row->render);
-			//E.rowoff = i - E.screenrows / 3;
-			E.rowoff = E.numrows;
-
-			saved_hl_line = current;
-			saved_hl = malloc(row->rsize);
-			memcpy(saved_hl, row->hl, row->rsize);
-			memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-			break;
-		}
+		ss->last_match = -1;
+		ss->direction = 1;
 	}
+
+	if (ss->last_match == -1) ss->direction = 1;
+	searchNarrow(ss, query, strlen(query));
+	searchShowMatch(ss, searchNextRow(ss, ss->last_match, ss->direction));
 }
 
-void editorFind(void) {
+// Search for a literal string, or a regex if regex is 1
+void editorFind(int regex) {
 	int saved_cx = E.cx;
 	int saved_cy = E.cy;
 	int saved_coloff = E.coloff;
 	int saved_rowoff = E.rowoff;
 
-	char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)",
+	E.search.regex = regex;
+	char *query = editorPrompt(regex ? "Regex: %s (Use ESC/Arrows/Enter)" :
+								"Search: %s (Use ESC/Arrows/Enter)",
 								editorFindCallback);
 
 	if (query) {
@@ -766,27 +5132,194 @@ void editorFind(void) {
 
 /* append buffer */
 
-// Append buffer initialization
-struct abuf {
-	char *b;
-	int len;
-};
-
-#define ABUF_INIT {NULL, 0}  // define it with a init funtion later
-
-void abAppend(struct abuf *ab, const char *s, int len) {
-	char *new = realloc(ab->b, ab->len + len);
+#define ABUF_MIN_CAP 4096
 
-	if (new == NULL)
-		return;
+// Make room for len more bytes, doubling the capacity as needed
+void abReserve(struct abuf *ab, int len) {
+	if (ab->len + len <= ab->cap) return;
 
-	memcpy(&new[ab->len], s, len);
+	int cap = ab->cap ? ab->cap : ABUF_MIN_CAP;
+	while (cap < ab->len + len) cap *= 2;
+	char *new = realloc(ab->b, cap);
+	if (new == NULL) die("realloc");
 	ab->b = new;
+	ab->cap = cap;
+}
+
+void abAppend(struct abuf *ab, const char *s, int len) {
+	abReserve(ab, len);
+	memcpy(&ab->b[ab->len], s, len);
 	ab->len += len;
 }
 
+// Empty the buffer but keep its memory for the next frame
+void abReset(struct abuf *ab) {
+	ab->len = 0;
+}
+
 void abFree(struct abuf *ab) {
 	free(ab->b);
+	ab->b = NULL;
+	ab->len = ab->cap = 0;
+}
+
+/* screen */
+
+// E.screen mirrors what the terminal shows. A frame is drawn line by
+// line into cells and only the cells that differ from the mirror are
+// sent, so a keystroke costs a few bytes instead of a full repaint.
+// Text lines are only rebuilt when their row was damaged, and scrolling
+// moves the lines that are already on the terminal.
+
+void cellSet(struct screenCell *c, const char *s, int n, int attr) {
+	memset(c->ch, 0, CELL_BYTES);
+	memcpy(c->ch, s, n);
+	c->attr = attr;
+}
+
+void screenReset(int rows, int cols) {
+	E.screen = realloc(E.screen, sizeof(struct screenCell) * rows * cols);
+	E.screen_line = realloc(E.screen_line, sizeof(struct screenCell) * cols);
+	E.screen_dirty = realloc(E.screen_dirty, rows);
+	if (E.screen == NULL || E.screen_line == NULL || E.screen_dirty == NULL)
+		die("realloc");
+
+	for (int i = 0; i < rows * cols; i++) cellSet(&E.screen[i], " ", 1, 0);
+	memset(E.screen_dirty, 1, rows);
+	E.screen_rows = rows;
+	E.screen_cols = cols;
+	E.term_x = -1;
+	E.term_y = -1;
+}
+
+void screenSetAttr(struct abuf *ab, int attr) {
+	if (attr == E.term_attr) return;
+
+	char buf[16];
+	int len = snprintf(buf, sizeof(buf), "\x1b[0%s", 
+					   (attr & CELL_INVERSE) ? ";7" : "");
+	if (attr & ~CELL_INVERSE)
+		len += snprintf(buf + len, sizeof(buf) - len, ";%d", attr & ~CELL_INVERSE);
+	buf[len++] = 'm';
+	abAppend(ab, buf, len);
+	E.term_attr = attr;
+}
+
+void screenMoveTo(struct abuf *ab, int y, int x) {
+	if (y == E.term_y && x == E.term_x) return;
+
+	if (y == E.term_y && x == 0) {
+		abAppend(ab, "\r", 1);
+	} else {
+		char buf[32];
+		int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+		abAppend(ab, buf, len);
+	}
+	E.term_y = y;
+	E.term_x = x;
+}
+
+// Write cells at the cursor, one SGR change and one append per run of
+// cells that share their attributes
+void screenWriteCells(struct abuf *ab, struct screenCell *cells, int n) {
+	int i = 0;
+	while (i < n) {
+		int attr = cells[i].attr;
+		screenSetAttr(ab, attr);
+		abReserve(ab, (n - i) * CELL_BYTES);
+		for (; i < n && cells[i].attr == attr; i++)
+			for (int j = 0; j < CELL_BYTES && cells[i].ch[j]; j++)
+				ab->b[ab->len++] = cells[i].ch[j];
+	}
+	E.term_x += n;
+	// The cursor is in limbo after writing the last column
+	if (E.term_x >= E.screen_cols) E.term_x = -1;
+}
+
+static int cellEqual(struct screenCell a, struct screenCell b) {
+	return memcmp(a.ch, b.ch, CELL_BYTES) == 0 && a.attr == b.attr;
+}
+
+static int cellBlank(struct screenCell c) {
+	return c.ch[0] == ' ' && c.ch[1] == '\0' && c.attr == 0;
+}
+
+// Bring screen line y up to line, sending only what changed
+void screenPutLine(struct abuf *ab, int y, struct screenCell *line) {
+	struct screenCell *old = &E.screen[y * E.screen_cols];
+	int cols = E.screen_cols;
+
+	// A blank tail is cleared with one erase instead of spaces
+	int tail = cols;
+	while (tail > 0 && cellBlank(line[tail - 1])) tail--;
+
+	int x = 0;
+	while (x < tail) {
+		if (cellEqual(line[x], old[x])) {
+			x++;
+			continue;
+		}
+		// Wide characters are written whole
+		if (line[x].ch[0] == '\0' && x > 0) x--;
+
+		// Unchanged gaps of a few cells are cheaper to write again than
+		// to jump over
+		int end = x + 1;
+		for (;;) {
+			while (end < tail && !cellEqual(line[end], old[end])) end++;
+			int gap = end;
+			while (gap < tail && gap - end < 4 && cellEqual(line[gap], old[gap]))
+				gap++;
+			if (gap == end || gap == tail || gap - end >= 4) break;
+			end = gap;
+		}
+		if (end < tail && line[end].ch[0] == '\0') end++;
+		screenMoveTo(ab, y, x);
+		screenWriteCells(ab, &line[x], end - x);
+		x = end;
+	}
+
+	for (x = tail; x < cols; x++) {
+		if (!cellEqual(line[x], old[x])) {
+			screenMoveTo(ab, y, tail);
+			screenSetAttr(ab, 0);
+			abAppend(ab, "\x1b[K", 3);
+			break;
+		}
+	}
+
+	memcpy(old, line, sizeof(struct screenCell) * cols);
+}
+
+// Scroll the top rows lines of the terminal by delta lines, up if delta
+// is positive. Lines that scroll in are blank and marked dirty.
+void screenScroll(struct abuf *ab, int rows, int delta) {
+	int n = abs(delta);
+	int cols = E.screen_cols;
+	char buf[32];
+
+	// Lines that scroll in are erased with the current attributes
+	screenSetAttr(ab, 0);
+	int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+					   rows, n, delta > 0 ? 'S' : 'T');
+	abAppend(ab, buf, len);
+	// Setting the scroll region homes the cursor
+	E.term_x = -1;
+	E.term_y = -1;
+
+	struct screenCell *keep, *blank;
+	if (delta > 0) {
+		memmove(E.screen, &E.screen[n * cols],
+				sizeof(struct screenCell) * (rows - n) * cols);
+		blank = &E.screen[(rows - n) * cols];
+		memset(&E.screen_dirty[rows - n], 1, n);
+	} else {
+		memmove(&E.screen[n * cols], E.screen,
+				sizeof(struct screenCell) * (rows - n) * cols);
+		blank = E.screen;
+		memset(E.screen_dirty, 1, n);
+	}
+	for (keep = blank; keep < blank + n * cols; keep++) cellSet(keep, " ", 1, 0);
 }
 
 /* output */
@@ -794,7 +5327,7 @@ void abFree(struct abuf *ab) {
 void editorScroll(void) {
 	E.rx = 0;
 	if (E.cy < E.numrows) {
-		E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+		E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
 	}
 
 	if (E.cy < E.rowoff) {
@@ -818,11 +5351,120 @@ void editorScroll(void) {
 	}
 }
 
+// Class of the highlight run that covers rx and where it ends, with the
+// search match drawn over the syntax spans. span is a cursor into the
+// row's spans and only moves forward.
+int editorRowRunAt(erow *row, int at, int rx, int *span, int *end) {
+	while (*span < row->hl_nspans &&
+		   row->hl[*span].start + (int)row->hl[*span].len <= rx)
+		(*span)++;
+
+	int hl = HL_NORMAL;
+	if (*span < row->hl_nspans && row->hl[*span].start <= rx) {
+		hl = row->hl[*span].hl;
+		*end = row->hl[*span].start + row->hl[*span].len;
+	} else {
+		*end = *span < row->hl_nspans ? row->hl[*span].start : row->rsize;
+	}
+
+	if (at == E.match_row) {
+		int mend = E.match_rx + E.match_len;
+		if (rx >= E.match_rx && rx < mend) {
+			hl = HL_MATCH;
+			*end = mend;
+		} else if (rx < E.match_rx && *end > E.match_rx) {
+			*end = E.match_rx;
+		}
+	}
+	return hl;
+}
+
+// Put the character s of n bytes into line at x, which must have room
+// for its width. Returns the column after it.
+int linePut(struct screenCell *line, int x, const char *s, int n, int width,
+			int attr) {
+	if (width == 0) {
+		// Marks go over the character before them, as many as fit
+		if (x == 0) return x;
+		struct screenCell *c = &line[x - 1];
+		if (c->ch[0] == '\0' && x > 1) c--;
+		int used = strnlen(c->ch, CELL_BYTES);
+		if (used + n <= CELL_BYTES) memcpy(&c->ch[used], s, n);
+		return x;
+	}
+	cellSet(&line[x], s, n, attr);
+	if (width == 2) cellSet(&line[x + 1], "", 0, attr);
+	return x + width;
+}
+
+// Fill the cells of line from x on with the UTF-8 text s, clipped to the
+// screen. Returns the column after the text.
+int lineFill(struct screenCell *line, int x, const char *s, int len,
+			 int attr) {
+	int i = 0;
+	while (i < len && x < E.screencols) {
+		int cp;
+		int n = utf8Decode(&s[i], len - i, &cp);
+		int width = cp == -1 ? 1 : utf8Width(cp);
+		if (x + width > E.screencols) break;
+		if (cp == -1 || cp < ' ' || (cp >= 0x7f && cp < 0xa0))
+			x = linePut(line, x, "?", 1, 1, attr);
+		else
+			x = linePut(line, x, &s[i], n, width, attr);
+		i += n;
+	}
+	return x;
+}
+
+void lineClear(struct screenCell *line, int x, int attr) {
+	for (; x < E.screencols; x++) cellSet(&line[x], " ", 1, attr);
+}
+
+// Draw the visible part of a row into line. rx walks the render bytes,
+// x the screen columns, which start at the character coloff falls in.
+void editorBuildRow(struct screenCell *line, erow *row, int at) {
+	int rx = editorRowMapPos(row, E.coloff, POS_SCREEN, POS_RENDER);
+	int x = editorRowMapPos(row, rx, POS_RENDER, POS_SCREEN) - E.coloff;
+	int span = 0;
+	while (rx < row->rsize && x < E.screencols) {
+		int end;
+		int hl = editorRowRunAt(row, at, rx, &span, &end);
+		int attr = hl == HL_NORMAL ? 0 : editorSyntaxToColor(hl);
+		while (rx < end && x < E.screencols) {
+			char *s = &row->render[rx];
+			int cp;
+			int n = utf8Decode(s, row->rsize - rx, &cp);
+			int width = cp == -1 ? 1 : utf8Width(cp);
+			rx += n;
+
+			if (x < 0 || x + width > E.screencols) {
+				// Cut by the edge of the screen
+				for (; width > 0; width--, x++)
+					if (x >= 0 && x < E.screencols) cellSet(&line[x], " ", 1, attr);
+			} else if (cp >= 0 && cp < ' ') {
+				// Convert control characters to uppercase letters by adding '@' to their value
+				char c = '@' + cp;
+				x = linePut(line, x, &c, 1, 1, attr | CELL_INVERSE);
+			} else if (cp == -1 || (cp >= 0x7f && cp < 0xa0)) {
+				x = linePut(line, x, "?", 1, 1, attr | CELL_INVERSE);
+			} else {
+				x = linePut(line, x, s, n, width, attr);
+			}
+		}
+	}
+	lineClear(line, x > 0 ? x : 0, 0);
+}
+
 void editorDrawRows(struct abuf *ab) {
+	// Visible rows first, whatever is left over is done while idle
+	editorSyntaxAdvance(E.rowoff + E.screenrows, TEXTOPRAK_HL_BUDGET);
+
+	struct screenCell *line = E.screen_line;
+	erow *row = editorRowAt(E.rowoff);
 	int y = 0;
 	for (y = 0; y < E.screenrows; y++) {
-		int filerow = y + E.rowoff;
-		if (filerow >= E.numrows) {
+		if (row == NULL) {
+			int x = lineFill(line, 0, "~", 1, 0);
 			if (E.numrows == 0 && y == E.screenrows / 3) {
 				char welcome[DEFAULT_BUFFER_SIZE];
 				int welcomelen = snprintf(welcome, sizeof(welcome),
@@ -831,165 +5473,160 @@ void editorDrawRows(struct abuf *ab) {
 					welcomelen = E.screencols;
 
 				int padding = (E.screencols - welcomelen) / 2;
-				if (padding) {
-					abAppend(ab, "~", 1);
-					padding--;
-				}
-				while (padding--) 
-					abAppend(ab, " ", 1);
-
-				abAppend(ab, welcome, welcomelen);
-
-			} else {
-				abAppend(ab, "~", 1);
+				if (padding == 0) x = 0;
+				lineClear(line, x, 0);
+				x = lineFill(line, padding, welcome, welcomelen, 0);
 			}
+			lineClear(line, x, 0);
+			screenPutLine(ab, y, line);
 		} else {
-			int len = E.row[filerow].rsize - E.coloff;
-			if (len < 0) len = 0;
-			if (len > E.screencols) len = E.screencols;
-			char *c = &E.row[filerow].render[E.coloff];
-			unsigned char *hl = &E.row[filerow].hl[E.coloff];
-			int current_color = -1;
-			int j;
-			for (j = 0; j < len; j++) {
-				if (iscntrl(c[j])) {
-					// Convert control characters to uppercase letters by adding '@' to their value
-					char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-					// Invert colors
-					abAppend(ab, "\x1b[7m", 4);
-					abAppend(ab, &sym, 1);
-					abAppend(ab, "\x1b[m", 3);
-					if (current_color != -1) {
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-						abAppend(ab, buf, clen);
-					}
-				} else if (hl[j] == HL_NORMAL) {
-					if (current_color != -1) {
-						abAppend(ab, "\x1b[39m", 5);
-						current_color = -1;
-					}
-					abAppend(ab, &c[j], 1);
-				} else {
-					int color = editorSyntaxToColor(hl[j]);
-					if (color != current_color) {
-						current_color = color;
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-						abAppend(ab, buf, clen);
-					}
-					abAppend(ab, &c[j], 1);
-				}
+			// Rendering may re-lex the row, which damages it if the
+			// highlighting changed
+			int at = y + E.rowoff;
+			editorRowRender(row, at);
+			if (row->damaged || E.screen_dirty[y] || at >= E.damage_from) {
+				editorBuildRow(line, row, at);
+				screenPutLine(ab, y, line);
+				row->damaged = 0;
 			}
-			abAppend(ab, "\x1b[39m", 5);
+			row = editorRowNext(row);
 		}
-
-		abAppend(ab, "\x1b[K", 3);
-		abAppend(ab, "\r\n", 2);
+		E.screen_dirty[y] = 0;
 	}
 }
 
 void editorDrawStatusBar(struct abuf *ab) {
-	// Switch to inverted color mode
-	abAppend(ab, "\x1b[7m", 4);
-	
 	char status[DEFAULT_BUFFER_SIZE];
-	char rstatus[DEFAULT_BUFFER_SIZE];
+	char rstatus[DEFAULT_BUFFER_SIZE * 2];  // room for all its parts
+	char matches[DEFAULT_BUFFER_SIZE / 2];
+	char saving[32] = "";
 	
 	int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
 		E.filename ? E.filename : "[No Name]", E.numrows,
 		E.dirty ? "(modified)" : "");
 	
-	int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-		E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
-
+	searchStatus(&E.search, matches, sizeof(matches));
+	if (E.save.active)
+		snprintf(saving, sizeof(saving), "saving %d%% | ", editorSavePercent());
+	// The offset CTRL-B goes to: one newline per line, so on a file with
+	// CRLF endings it is not where the cursor is on disk
+	long long offset = editorRowOffset(E.cy) + E.cx;
+	int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s%.20s | %d/%d | offset %lld",
+		saving, matches, E.syntax ? E.syntax->filetype : "no ft", E.cy + 1,
+		E.numrows, offset);
+
+	// Inverted colors, file info on the left and position on the right
+	struct screenCell *line = E.screen_line;
+	if (len > (int)sizeof(status) - 1) len = sizeof(status) - 1;
+	if (rlen > (int)sizeof(rstatus) - 1) rlen = sizeof(rstatus) - 1;
 	if (len > E.screencols) len = E.screencols;
-	abAppend(ab, status, len);
-	
-	while (len < E.screencols) {
-		if (E.screencols - len == rlen) {
-			abAppend(ab, rstatus, rlen);
-			break;
-		} else {
-			abAppend(ab, " ", 1);
-			len++;
-		}
-	}
-	// Switch back to normal mode
-	abAppend(ab, "\x1b[m", 3);
-	// Make room for the second line of status bar
-	abAppend(ab, "\r\n", 2);
+	lineClear(line, lineFill(line, 0, status, len, CELL_INVERSE), CELL_INVERSE);
+	if (len + rlen <= E.screencols)
+		lineFill(line, E.screencols - rlen, rstatus, rlen, CELL_INVERSE);
+	screenPutLine(ab, E.screenrows, line);
 }
 
 void editorDrawMessageBar(struct abuf *ab) {
-	abAppend(ab, "\x1b[7m", 4);
-	
-	abAppend(ab, "\x1b[K", 3);
-
 	char rbuf[DEFAULT_BUFFER_SIZE];
 	int rlen = snprintf(rbuf, sizeof(rbuf), "Col: %d/%d",
 		E.rx + 1, E.cx > E.screencols ? E.cx + 1: E.screencols);
 
+	struct screenCell *line = E.screen_line;
 	int msglen = strlen(E.statusmsg);
 	if (msglen > E.screencols) msglen = E.screencols;
 
-	if (msglen && time(NULL) - E.statusmsg_time < 5) {
-		abAppend(ab, E.statusmsg, msglen);	
+	E.statusmsg_drawn = msglen &&
+		time(NULL) - E.statusmsg_time < STATUS_MESSAGE_SECONDS;
+	int x;
+	if (E.statusmsg_drawn) {
+		x = lineFill(line, 0, E.statusmsg, msglen, CELL_INVERSE);
 	} 
 	// Let's make a little fun
 	else {
 		msglen = strlen(E.username);
-		abAppend(ab, E.username, msglen);
+		x = lineFill(line, 0, E.username, msglen, CELL_INVERSE);
 	}
 
-	while (msglen < E.screencols) {
-		if (E.screencols - msglen == rlen) {
-			abAppend(ab, rbuf, rlen);
-			break;
-		} else {
-			abAppend(ab, " ", 1);
-			msglen++;
+	lineClear(line, x, CELL_INVERSE);
+	if (msglen + rlen <= E.screencols)
+		lineFill(line, E.screencols - rlen, rbuf, rlen, CELL_INVERSE);
+	screenPutLine(ab, E.screenrows + 1, line);
+}
+
+// Write as much of the pending frame as the terminal takes without
+// blocking. Returns 1 once all of it is out.
+int editorFlushOutput(void) {
+	while (E.out_sent < E.out.len) {
+		ssize_t n = write(E.outfd, &E.out.b[E.out_sent], E.out.len - E.out_sent);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			die("write");
 		}
+		E.out_sent += n;
 	}
-	abAppend(ab, "\x1b[m", 3);
+	return 1;
+}
+
+int editorOutputPending(void) {
+	return E.out_sent < E.out.len;
 }
 
+// Draw a frame. While the terminal has not taken the previous one or
+// more keys are waiting the frame is dropped, once it has the latest
+// state is drawn in one go; the diff against the shadow screen covers
+// every dropped frame.
 void editorRefreshScreen(void) {
+	editorCheckResize();
 	editorScroll();
 
-	struct abuf ab = ABUF_INIT;
+	// Keys that are already typed are applied first, the frame shows
+	// all of them at once
+	if (editorInputPending() || !editorFlushOutput()) {
+		E.redraw = 1;
+		return;
+	}
+	E.redraw = 0;
+
+	struct abuf *ab = &E.out;
+	abReset(ab);
+	E.out_sent = 0;
+
+	// Hide the cursor while cells are redrawn, skipped below if only the
+	// cursor moves
+	abAppend(ab, "\x1b[?25l", 6);
 
 	// Escape character is x1b: 27 in decimal
 	// Escape sequences start with escape character and followed by '['
-	
-	// Hide the cursor 
-	abAppend(&ab, "\x1b[?25l", 6);
 
-	// Cursor left at the bottom of the screen
-	// Reposition the cursor at the beginning of the screen
-	abAppend(&ab, "\x1b[H", 3);
+	if (E.screenrows + 2 != E.screen_rows || E.screencols != E.screen_cols) {
+		screenReset(E.screenrows + 2, E.screencols);
+		abAppend(ab, "\x1b[2J", 4);
+	} else if (E.coloff != E.screen_coloff) {
+		memset(E.screen_dirty, 1, E.screenrows);
+	} else if (E.rowoff != E.screen_rowoff) {
+		// Move the lines that stay visible instead of drawing them again
+		int delta = E.rowoff - E.screen_rowoff;
+		if (abs(delta) < E.screenrows) screenScroll(ab, E.screenrows, delta);
+		else memset(E.screen_dirty, 1, E.screenrows);
+	}
+	E.screen_rowoff = E.rowoff;
+	E.screen_coloff = E.coloff;
 
-	// Resizing window
-	if (getWindowSize(&E.screenrows, &E.screencols) == -1) {
-		die("getWindowSize");
-	} 
-	E.screenrows -= 2;  // reserved for status bar and message bar
+	editorDrawRows(ab);
+	editorDrawStatusBar(ab);
+	editorDrawMessageBar(ab);
+	screenSetAttr(ab, 0);
+	E.damage_from = INT_MAX;
+	int drawn = ab->len > 6;
 
-	editorDrawRows(&ab);
-	editorDrawStatusBar(&ab);
-	editorDrawMessageBar(&ab);
-	
 	// Moving the cursor
-	char buf[32];
-	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, 
-											  (E.rx - E.coloff) + 1);
-	abAppend(&ab, buf, strlen(buf));
+	screenMoveTo(ab, E.cy - E.rowoff, E.rx - E.coloff);
 
-	abAppend(&ab, "\x1b[?25h", 6);
-
-	// write(STDOUT_FILENO, "Hello", 5);
-	write(STDOUT_FILENO, ab.b, ab.len);  // print out to STDOUT
-	abFree(&ab);  // free resources
+	if (drawn) abAppend(ab, "\x1b[?25h", 6);
+	else E.out_sent = 6;
+	if (E.bench.active && ab->len > E.out_sent) benchFrame(ab->len - E.out_sent);
+	editorFlushOutput();
 }
 
 /* Footer */
@@ -1057,6 +5694,21 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 				if (callback) callback(buf, c);
 				return buf;
 			}
+		} else if (c == PASTE_START) {
+			// Only the first line of pasted text goes into the prompt
+			int len, next;
+			char *text = editorReadPaste(&len);
+			len = lineLength(text, len, &next);
+			for (int i = 0; i < len; i++) {
+				if (iscntrl((unsigned char)text[i])) continue;
+				if (buflen == bufsize - 1) {
+					bufsize *= 2;
+					buf = realloc(buf, bufsize);
+				}
+				buf[buflen++] = text[i];
+			}
+			buf[buflen] = '\0';
+			free(text);
 		} else if (!iscntrl(c) && c < 128) {
 			if (buflen == bufsize - 1) {
 				bufsize *= 2;
@@ -1071,20 +5723,20 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 }
 
 void editorMoveCursor(int key) {
-	erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+	erow *row = editorRowAt(E.cy);
 
 	switch (key) {
 		case ARROW_LEFT:
 			if (E.cx != 0) {
-				E.cx--;
+				E.cx = editorRowStep(row, E.cx, -1);
 			} else if (E.cx == 0 && E.cy > 0) {
 				E.cy--;
-				E.cx = E.row[E.cy].size;
+				E.cx = editorRowAt(E.cy)->size;
 			}
 			break;
 		case ARROW_RIGHT:
 			if (row && E.cx < row->size) {
-				E.cx++;
+				E.cx = editorRowStep(row, E.cx, 1);
 			} else if (row && E.cx == row->size){
 				E.cy++;
 				E.cx = 0;
@@ -1102,10 +5754,34 @@ void editorMoveCursor(int key) {
 			break;
 	}
 
-	row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-	int rowlen = row ? row->size : 0;
-	if (E.cx > rowlen) {
-		E.cx = rowlen;
+	editorSnapCursor();
+}
+
+// Ask for a line number, or a byte offset from the start of the file
+// counting one newline per row, and move the cursor there
+void editorGoto(int bytes) {
+	char *buf = editorPrompt(bytes ? "Go to byte: %s (ESC to cancel)"
+								   : "Go to line: %s (ESC to cancel)", NULL);
+	if (buf == NULL) return;
+
+	char *end;
+	errno = 0;
+	long long n = strtoll(buf, &end, 10);
+	int bad = errno || end == buf || *end != '\0' || n < (bytes ? 0 : 1);
+	free(buf);
+	if (bad) {
+		editorSetStatusMessage(bytes ? "Not a byte offset" : "Not a line number");
+		return;
+	}
+
+	if (bytes) {
+		long long start;
+		E.cy = editorOffsetRow(n, &start);
+		E.cx = n - start < INT_MAX ? n - start : INT_MAX;
+		editorSnapCursor();
+	} else {
+		E.cy = n - 1 < E.numrows ? n - 1 : E.numrows;
+		E.cx = 0;
 	}
 }
 
@@ -1113,6 +5789,9 @@ void editorProcessKeypress(void) {
 	static int quit_times = TEXTOPRAK_QUIT_TIMES_DEFAULT;
 
 	int c = editorReadKey();
+	int typing = 0;  // typed characters are undone together
+	E.undo.cx = E.cx;
+	E.undo.cy = E.cy;
 
 	switch (c) {
 		case '\r':
@@ -1120,14 +5799,15 @@ void editorProcessKeypress(void) {
 			break;
 
 		case CTRL_KEY('q'):
+			editorSaveWait();
 			if (E.dirty && quit_times > 0) {
 				editorSetStatusMessage("WARNING! File has unsaved changes. "
 					"Press CTRL-Q %d more times to quit.", quit_times);
 				quit_times--;
 				return;
 			}
-			write(STDOUT_FILENO, "\x1b[2J", 4);
-			write(STDOUT_FILENO, "\x1b[H", 3);
+			journalRemove();
+			editorClearTerminal();
 			exit(0);
 			break;
 
@@ -1135,17 +5815,29 @@ void editorProcessKeypress(void) {
 			editorSave();
 			break;
 
+		case CTRL_KEY('z'):
+			editorUndo();
+			break;
+
+		case CTRL_KEY('y'):
+			editorRedo();
+			break;
+
 		case HOME_KEY:
 			E.cx = 0;
 			break;
 
 		case END_KEY:
 			if (E.cy < E.numrows)
-				E.cx = E.row[E.cy].size;
+				E.cx = editorRowAt(E.cy)->size;
 			break;
 
 		case CTRL_KEY('f'):
-			editorFind();
+			editorFind(0);
+			break;
+
+		case CTRL_KEY('r'):
+			editorFind(1);
 			break;
 
 		case BACKSPACE:
@@ -1153,23 +5845,32 @@ void editorProcessKeypress(void) {
 		case DEL_KEY:
 			if (c == DEL_KEY) editorMoveCursor(ARROW_RIGHT);
 			editorDelChar();
+			typing = 1;
 			break;
 
 		case PAGE_UP:
 		case PAGE_DOWN:
 			{
+				// A screen up or down from the top or bottom line in one step
 				if (c == PAGE_UP) {
-					E.cy = E.rowoff;
+					E.cy = E.rowoff - E.screenrows;
+					if (E.cy < 0) E.cy = 0;
 				} else if (c == PAGE_DOWN) {
-					E.cy = E.rowoff + E.screenrows - 1;
+					E.cy = E.rowoff + 2 * E.screenrows - 1;
 					if (E.cy > E.numrows) E.cy = E.numrows;
 				}
-				int times  = E.screenrows;
-				while (times--)
-					editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+				editorSnapCursor();
 			}
 			break;
 
+		case CTRL_KEY('g'):
+			editorGoto(0);
+			break;
+
+		case CTRL_KEY('b'):
+			editorGoto(1);
+			break;
+
 		case ARROW_UP:
 		case ARROW_DOWN:
 		case ARROW_LEFT:
@@ -1181,14 +5882,297 @@ void editorProcessKeypress(void) {
 		case '\x1b':
 			break;
 
+		case PASTE_START:
+			editorPaste();
+			break;
+
 		default:
 			editorInsertChar(c);
+			typing = 1;
 			break;
 	}
 
+	undoEndKey(typing);
 	quit_times = cfg.quit_times;
 }
 
+/* bench
+ *
+ * --bench replays a script of keys against the file without a terminal.
+ * The script holds the bytes a terminal would send, one key is fed at a
+ * time, and an operation lasts from feeding a key until the editor asks
+ * for the next one with every frame drawn and any search or save it
+ * started finished. Frames go to /dev/null, a terminal of --size. Once
+ * the script is done the latency of each kind of operation, the bytes of
+ * each frame and, in a build made with -DTEXTOPRAK_BENCH, the calls into
+ * the allocator are printed.
+ */
+
+static const char *bench_kind_names[BENCH_KINDS] = {
+	"edit", "paste", "move", "search", "undo", "save", "other"
+};
+
+#ifdef TEXTOPRAK_BENCH
+#ifndef __GLIBC__
+#error "TEXTOPRAK_BENCH counts allocations through glibc"
+#endif
+// glibc lets a program replace the allocator. These count the calls and
+// hand them on to glibc's own. Only `make bench` builds them in, the
+// editor itself keeps the allocator of the C library.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *p);
+
+static void benchCountAlloc(size_t size) {
+	if (!E.bench.active) return;
+	__atomic_add_fetch(&E.bench.allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&E.bench.alloc_bytes, (long long)size, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size) {
+	benchCountAlloc(size);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+	benchCountAlloc(n * size);
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+	benchCountAlloc(size);
+	return __libc_realloc(p, size);
+}
+
+void *memalign(size_t align, size_t size) {
+	benchCountAlloc(size);
+	return __libc_memalign(align, size);
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+	return memalign(align, size);
+}
+
+int posix_memalign(void **p, size_t align, size_t size) {
+	if (align % sizeof(void *) != 0 || (align & (align - 1)) != 0) return EINVAL;
+	void *mem = memalign(align, size);
+	if (mem == NULL) return ENOMEM;
+	*p = mem;
+	return 0;
+}
+
+void free(void *p) {
+	__libc_free(p);
+}
+#endif
+
+long long benchNow(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void benchPush(long long **list, int *n, int *cap, long long v) {
+	if (*n == *cap) {
+		*cap = *cap ? *cap * 2 : 1024;
+		*list = realloc(*list, sizeof(long long) * *cap);
+		if (*list == NULL) die("realloc");
+	}
+	(*list)[(*n)++] = v;
+}
+
+// Called for every frame with the bytes it sends to the terminal
+void benchFrame(int bytes) {
+	struct bench *b = &E.bench;
+	benchPush(&b->frames, &b->nframes, &b->frames_cap, bytes);
+}
+
+// End of the key starting at pos: an escape sequence, a whole bracketed
+// paste or a single byte
+int benchKeyEnd(int pos) {
+	struct bench *b = &E.bench;
+	const char *s = b->script;
+	int len = b->len;
+	if (s[pos] != '\x1b' || pos + 1 == len) return pos + 1;
+
+	if (len - pos >= 6 && memcmp(&s[pos], "\x1b[200~", 6) == 0) {
+		for (int i = pos + 6; i + PASTE_END_LEN <= len; i++)
+			if (memcmp(&s[i], PASTE_END, PASTE_END_LEN) == 0) return i + PASTE_END_LEN;
+		return len;
+	}
+	if (s[pos + 1] == 'O') return pos + 3 < len ? pos + 3 : len;
+	if (s[pos + 1] != '[') return pos + 1;
+
+	int i = pos + 2;
+	while (i < len && (s[i] < 0x40 || s[i] > 0x7e)) i++;
+	return i < len ? i + 1 : len;
+}
+
+// What kind of operation the key from pos to end starts. Keys typed into
+// a prompt count for what the prompt is for.
+int benchKind(int pos, int end) {
+	struct bench *b = &E.bench;
+	const char *s = &b->script[pos];
+	int len = end - pos;
+	int kind;
+
+	if (b->prompt != -1) {
+		kind = b->prompt;
+		if (s[0] == '\r' || (s[0] == '\x1b' && len == 1)) b->prompt = -1;
+		return kind;
+	}
+
+	if (s[0] == '\x1b' && len > 1) {
+		if (len >= 6 && memcmp(s, "\x1b[200~", 6) == 0) return BENCH_PASTE;
+		return len == 4 && memcmp(s, "\x1b[3~", 4) == 0 ? BENCH_EDIT : BENCH_MOVE;
+	}
+
+	switch (s[0]) {
+		case CTRL_KEY('f'):
+		case CTRL_KEY('r'):
+			b->prompt = BENCH_SEARCH;
+			return BENCH_SEARCH;
+		case CTRL_KEY('g'):
+		case CTRL_KEY('b'):
+			b->prompt = BENCH_MOVE;
+			return BENCH_MOVE;
+		case CTRL_KEY('z'):
+		case CTRL_KEY('y'):
+			return BENCH_UNDO;
+		case CTRL_KEY('s'):
+			return BENCH_SAVE;
+		case CTRL_KEY('q'):
+		case CTRL_KEY('l'):
+		case '\x1b':
+			return BENCH_OTHER;
+	}
+	return BENCH_EDIT;
+}
+
+void benchEndOp(void) {
+	struct bench *b = &E.bench;
+	if (b->op_start == 0) return;
+	struct benchOps *ops = &b->ops[b->kind];
+	benchPush(&ops->ns, &ops->n, &ops->cap, benchNow() - b->op_start);
+	ops->allocs += b->allocs - b->op_allocs;
+	b->op_start = 0;
+}
+
+// Called by the event loop instead of reading the terminal. Puts more of
+// the script into the input buffer once what the last key started is
+// done, returns 0 while it is not.
+int benchFeed(void) {
+	struct bench *b = &E.bench;
+	if (E.search.job.active || E.save.active) return 0;
+
+	if (b->pos == b->key_end) {
+		benchEndOp();
+		if (b->pos == b->len) exit(0);
+		b->key_end = benchKeyEnd(b->pos);
+		b->kind = benchKind(b->pos, b->key_end);
+		b->op_allocs = b->allocs;
+		b->op_start = benchNow();
+	}
+
+	// A paste bigger than the buffer comes in parts, the end marker in
+	// one piece with the last
+	if (E.inpos == E.inlen) E.inpos = E.inlen = 0;
+	int n = b->key_end - b->pos;
+	int room = sizeof(E.inbuf) - E.inlen;
+	if (n > room) n = room - PASTE_END_LEN;
+	memcpy(&E.inbuf[E.inlen], &b->script[b->pos], n);
+	E.inlen += n;
+	b->pos += n;
+	return 1;
+}
+
+static int llCmp(const void *a, const void *b) {
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+long long benchPercentile(long long *v, int n, int p) {
+	if (n == 0) return 0;
+	int i = (long long)n * p / 100;
+	return v[i < n ? i : n - 1];
+}
+
+// Printed when the editor exits, once the script is done or it quit
+void benchReport(void) {
+	struct bench *b = &E.bench;
+	benchEndOp();
+
+	int ops = 0;
+	for (int k = 0; k < BENCH_KINDS; k++) ops += b->ops[k].n;
+	printf("%d operations, %d frames, terminal %dx%d, %.3f s\n", ops, b->nframes,
+		   b->rows, b->cols, (benchNow() - b->start) / 1e9);
+
+	printf("\n%-8s %8s %10s %10s %10s %10s", "op", "count", "p50 us",
+		   "p90 us", "p99 us", "max us");
+#ifdef TEXTOPRAK_BENCH
+	printf(" %10s", "allocs/op");
+#endif
+	printf("\n");
+	for (int k = 0; k < BENCH_KINDS; k++) {
+		struct benchOps *o = &b->ops[k];
+		if (o->n == 0) continue;
+		qsort(o->ns, o->n, sizeof(long long), llCmp);
+		printf("%-8s %8d %10.1f %10.1f %10.1f %10.1f", bench_kind_names[k],
+			   o->n, benchPercentile(o->ns, o->n, 50) / 1e3,
+			   benchPercentile(o->ns, o->n, 90) / 1e3,
+			   benchPercentile(o->ns, o->n, 99) / 1e3,
+			   o->ns[o->n - 1] / 1e3);
+#ifdef TEXTOPRAK_BENCH
+		printf(" %10.1f", (double)o->allocs / o->n);
+#endif
+		printf("\n");
+	}
+
+	long long total = 0;
+	for (int i = 0; i < b->nframes; i++) total += b->frames[i];
+	qsort(b->frames, b->nframes, sizeof(long long), llCmp);
+	printf("\nframe bytes: p50 %lld, p90 %lld, p99 %lld, max %lld, total %lld\n",
+		   benchPercentile(b->frames, b->nframes, 50),
+		   benchPercentile(b->frames, b->nframes, 90),
+		   benchPercentile(b->frames, b->nframes, 99),
+		   b->nframes ? b->frames[b->nframes - 1] : 0, total);
+
+#ifdef TEXTOPRAK_BENCH
+	printf("allocations: %lld calls, %lld bytes\n", b->allocs, b->alloc_bytes);
+#else
+	printf("allocations: not counted, build with make bench\n");
+#endif
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	printf("peak rss: %ld KiB\n", ru.ru_maxrss);
+	fflush(stdout);
+}
+
+// Set up the fake terminal before the editor is initialized
+void benchStart(void) {
+	struct bench *b = &E.bench;
+	int fd = open(b->path, O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) die(b->path);
+	b->script = malloc(st.st_size ? st.st_size : 1);
+	if (b->script == NULL) die("malloc");
+	if (read(fd, b->script, st.st_size) != st.st_size) die(b->path);
+	close(fd);
+	b->len = st.st_size;
+
+	// The terminal never has input, keys only come from the script
+	fd = open("/dev/null", O_RDONLY);
+	if (fd == -1 || dup2(fd, STDIN_FILENO) == -1) die("/dev/null");
+	close(fd);
+
+	b->prompt = -1;
+	b->start = benchNow();
+	b->active = 1;
+	atexit(benchReport);
+}
+
 /* Configuration */
 
 void checkConfigFile(const char *fname) {
@@ -1204,6 +6188,11 @@ void checkConfigFile(const char *fname) {
 		
 		fprintf(fptr, "tab_stop = %d\n", TEXTOPRAK_TAB_STOP_DEFAULT);
 		fprintf(fptr, "quit_times = %d\n", TEXTOPRAK_QUIT_TIMES_DEFAULT);
+		fprintf(fptr, "mmap_open = %d\n", TEXTOPRAK_MMAP_OPEN_DEFAULT);
+		fprintf(fptr, "syntax_dir = %s\n", TEXTOPRAK_SYNTAX_DIR_DEFAULT);
+		fprintf(fptr, "undo_memory = %d\n", TEXTOPRAK_UNDO_MEMORY_DEFAULT);
+		fprintf(fptr, "page_memory = %d\n", TEXTOPRAK_PAGE_MEMORY_DEFAULT);
+		fprintf(fptr, "journal = %d\n", TEXTOPRAK_JOURNAL_DEFAULT);
 
 		fclose(fptr);
 	}
@@ -1226,9 +6215,29 @@ void readConfigFile(const char *fname, struct config *cfg) {
 			if (strcmp(key, "tab_stop") == 0 ||
 				strcmp(key, "tab_stop ") == 0) {
 				cfg->tab_stop = atoi(value);
+				// Column marks keep the width of a tab in a byte
+				if (cfg->tab_stop < 1 || cfg->tab_stop > 255)
+					cfg->tab_stop = TEXTOPRAK_TAB_STOP_DEFAULT;
 			} else if (strcmp(key, "quit_times") == 0 || 
 				strcmp(key, "quit_times ") == 0) {
 				cfg->quit_times = atoi(value);
+			} else if (strcmp(key, "mmap_open") == 0 ||
+				strcmp(key, "mmap_open ") == 0) {
+				cfg->mmap_open = atoi(value);
+			} else if (strcmp(key, "syntax_dir") == 0 ||
+				strcmp(key, "syntax_dir ") == 0) {
+				while (*value == ' ') value++;
+				free(cfg->syntax_dir);
+				cfg->syntax_dir = strdup(value);
+			} else if (strcmp(key, "undo_memory") == 0 ||
+				strcmp(key, "undo_memory ") == 0) {
+				cfg->undo_memory = atoi(value);
+			} else if (strcmp(key, "page_memory") == 0 ||
+				strcmp(key, "page_memory ") == 0) {
+				cfg->page_memory = atoi(value);
+			} else if (strcmp(key, "journal") == 0 ||
+				strcmp(key, "journal ") == 0) {
+				cfg->journal = atoi(value);
 			}
 		}
 	}
@@ -1243,41 +6252,119 @@ void initEditor(void) {
 	E.rx = 0;
 	E.rowoff = 0;
 	E.numrows = 0;
-	E.row = NULL;
+	E.pages = NULL;
+	E.npages = 0;
+	E.page_lines = NULL;
+	E.page_bytes = NULL;
+	E.paged = 0;
+	E.remap = 0;
+	pageTableInit(calloc(1, sizeof(struct rowPage)), 1);
+	pageLoad(&E.pages[0]);
 	E.dirty = 0;
 	E.filename = NULL;
 	E.username = NULL;
 	E.statusmsg[0] = '\0';  // null terminator
 	E.statusmsg_time = 0;
+	E.statusmsg_drawn = 0;
+	E.inpos = 0;
+	E.inlen = 0;
 	E.syntax = NULL;
+	E.syntaxes = NULL;
+	E.nsyntaxes = 0;
+	E.hl_pending = NULL;
+	memset(&E.search, 0, sizeof(E.search));
+	E.search.last_match = -1;
+	editorSaveInit();
+	memset(&E.undo, 0, sizeof(E.undo));
+	memset(&E.journal, 0, sizeof(E.journal));
+	E.journal.fd = -1;
+	E.epoch = 0;
+	E.search.direction = 1;
+	E.match_row = -1;
+	E.screen = NULL;
+	E.screen_line = NULL;
+	E.screen_dirty = NULL;
+	E.screen_rows = 0;
+	E.screen_cols = 0;
+	E.damage_from = INT_MAX;
+	E.term_x = -1;
+	E.term_y = -1;
+	E.term_attr = 0;
+	E.outfd = editorOpenOutput();
+	E.out = (struct abuf)ABUF_INIT;
+	E.out_sent = 0;
+	E.redraw = 0;
+	E.hl_npending = 0;
+	E.hl_pending_cap = 0;
+	E.map = NULL;
+	E.mapsize = 0;
 
 	if (getWindowSize(&E.screenrows, &E.screencols) == -1)
 		die("getWindowSize");
 
 	E.screenrows -= 2;  // Reserved for status bar
 
+	E.resized = 0;
+	editorWatchResize();
+	// A hung up terminal is noticed when reading it fails, which goes
+	// through die and syncs the journal
+	signal(SIGHUP, SIG_IGN);
+
 	// Default values for cfg, not needed necessarily
 	cfg.tab_stop = TEXTOPRAK_TAB_STOP_DEFAULT;
 	cfg.quit_times = TEXTOPRAK_QUIT_TIMES_DEFAULT;
+	cfg.mmap_open = TEXTOPRAK_MMAP_OPEN_DEFAULT;
+	cfg.syntax_dir = strdup(TEXTOPRAK_SYNTAX_DIR_DEFAULT);
+	cfg.undo_memory = TEXTOPRAK_UNDO_MEMORY_DEFAULT;
+	cfg.page_memory = TEXTOPRAK_PAGE_MEMORY_DEFAULT;
+	cfg.journal = TEXTOPRAK_JOURNAL_DEFAULT;
 }
 
 int main(int argc, char *argv[]) {
-	enableRawMode();
+	// textoprak [--bench KEYS [--size ROWSxCOLS]] [FILE]
+	char *filename = NULL;
+	E.bench.rows = 24;
+	E.bench.cols = 80;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+			E.bench.path = argv[++i];
+		} else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc &&
+				   sscanf(argv[i + 1], "%dx%d", &E.bench.rows, &E.bench.cols) == 2 &&
+				   E.bench.rows > 2 && E.bench.cols > 0) {
+			i++;
+		} else if (argv[i][0] == '-' || filename) {
+			fprintf(stderr, "usage: %s [--bench KEYS [--size ROWSxCOLS]] [FILE]\n",
+					argv[0]);
+			return 1;
+		} else {
+			filename = argv[i];
+		}
+	}
+
+	if (E.bench.path) benchStart();
+	else enableRawMode();
 	initEditor();
 
-	// Read the config file if exists
-	checkConfigFile("textoprak.cfg");
-	readConfigFile("textoprak.cfg", &cfg);
-	if (argc >= 2) {
-		editorOpen(argv[1]);
+	// Read the config file if exists. Benchmark runs leave nothing behind:
+	// they don't create it, write a journal or the syntax cache.
+	if (!E.bench.active) checkConfigFile("textoprak.cfg");
+	if (!E.bench.active || access("textoprak.cfg", R_OK) == 0)
+		readConfigFile("textoprak.cfg", &cfg);
+	if (E.bench.active) cfg.journal = 0;
+	editorLoadSyntaxes(cfg.syntax_dir);
+	if (filename) {
+		editorOpen(filename);
 	}
 
 	editorSetStatusMessage(
-		"HELP: Ctrl-S = save | Ctrl-Q = quit | CTRL-F = find");
-	const char *username = editorGetUsername();
+		"HELP: Ctrl-S = save | Ctrl-Q = quit | CTRL-F = find | CTRL-R = regex");
+	const char *username = E.bench.active ? NULL : editorGetUsername();
 	editorSetUsername(username);
+	// Its prompt and messages go over the help
+	if (filename) journalOpen();
 
 	while (1) {
+		editorTrimPages();
 		editorRefreshScreen();
 		editorProcessKeypress();
 	}